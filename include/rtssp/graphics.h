@@ -18,6 +18,51 @@
 #include <glad/glad.h>
 #include <cglm/cglm.h>
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+// DEFINES //
+
+#define MAX_MESH_LODS           8       // The most levels of detail a mesh_lod_t can hold
+#define DEFAULT_VERTEX_FORMAT   VERTEX_FORMAT_PACKED  // The layout meshes are uploaded to VRAM with
+#define MAX_SHORT_INDEX_VERTICES 65536  // Meshes with at most this many vertices get 16 bit indices
+#define ACMR_CACHE_SIZE         16      // The size of the FIFO post-transform cache ACMR is measured against
+#define REPORT_MESH_OPTIMIZATION false  // Print the ACMR of each mesh before and after optimizeMesh
+
+#define MESH_CACHE_VERSION      1       // Bump whenever the baked mesh data changes so stale cache files are rebuilt
+#define MESH_CACHE_PATH_SIZE    512     // Room for the path of a mesh cache file
+#ifndef MESH_CACHE_DIRECTORY
+#define MESH_CACHE_DIRECTORY    "meshes"  // Where baked meshes are looked for and cached (set by CMake)
+#endif
+#define USE_PROGRAM_CACHE       true    // Cache linked shader programs on disk with glGetProgramBinary
+#define PROGRAM_CACHE_VERSION   1       // Bump whenever the program cache file layout changes
+#define PROGRAM_CACHE_PATH_SIZE 512     // Room for the path of a program cache file
+#ifndef PROGRAM_CACHE_DIRECTORY
+#define PROGRAM_CACHE_DIRECTORY "programs"  // Where linked program binaries are cached (set by CMake)
+#endif
+#define DEFAULT_LOD_HYSTERESIS  0.2f    // How far (as a fraction) below a threshold a mesh has to shrink before dropping detail
+#define GEOMETRY_BUFFER_VERTEX_BYTES  (8 << 20)   // The size of the vbo static meshes are suballocated from
+#define GEOMETRY_BUFFER_ELEMENT_BYTES (4 << 20)   // The size of the ebo static meshes are suballocated from
+#define INSTANCE_ATTRIBUTE_LOCATION 3   // The first of the four attribute locations instance_t is read through
+#define FRAME_BLOCK_BINDING     0       // The uniform buffer binding frame_block is read through
+#define DRAW_BLOCK_BINDING      1       // The uniform buffer binding draw_block is read through
+#define STREAM_RING_FRAMES      3       // The frames a stream ring holds the data of, so the CPU can run ahead of the GPU
+#define STREAM_RING_FRAME_BYTES (1 << 20)   // The room a stream ring has for a frame's data
+#define USE_PERSISTENT_MAPPING  true    // Keep stream rings mapped with GL_ARB_buffer_storage (core in OpenGL 4.4)
+
+#define MAX_SHADER_FEATURES     4       // The most feature flags a shader_variants_t can combine
+#define USE_PARALLEL_SHADER_COMPILE true  // Let the driver compile on its own threads (GL_KHR_parallel_shader_compile)
+#define SHADER_DEFINES_SIZE     256     // Room for the #defines of a shader variant's features
+#define MAX_CACHED_UNIFORMS     256     // The most uniform locations the state cache holds across all programs (a power of 2)
+#define UNIFORM_NAME_SIZE       64      // Room for the name of a cached uniform
+#define UNIFORM_VALUE_SIZE      64      // Uniforms up to this many bytes (a mat4) have their last value cached
+#define MAX_TEXTURE_UNITS       16      // The texture units the state cache keeps track of
+#define MAX_UNIFORM_BUFFER_BINDINGS 8   // The indexed uniform buffer bindings the state cache keeps track of
+#define MAX_CACHED_VERTEX_ARRAYS 8      // The vertex arrays the state cache keeps the element and vertex buffers of
+#define REPORT_GL_STATE_COUNTERS false  // Print how many binds and uniform updates were issued and elided each second
+
 
 // STRUCTS //
 
@@ -31,6 +76,27 @@ typedef struct {
   vec2 uv;          // The uv coordinates for texture mapping
 } vertex_t;
 
+/**
+ * @brief A packed_vertex_t is the 16 byte VRAM layout of a vertex_t. The position is stored as snorm16 in units of
+ * the mesh's position_scale, the normal as an octahedral snorm16 pair, and the uv as half floats.
+ * 
+ */
+typedef struct {
+  GLshort position[4];  // The position in units of position_scale (w is padding)
+  GLshort normal[2];    // The octahedral encoded normal vector
+  GLhalf uv[2];         // The uv coordinates for texture mapping
+} packed_vertex_t;
+
+/**
+ * @brief A vertex_format_t says which layout a mesh's vertices are stored with in VRAM
+ * 
+ */
+typedef enum {
+  VERTEX_FORMAT_FLOAT,    // vertex_t, 32 bytes per vertex
+  VERTEX_FORMAT_PACKED,   // packed_vertex_t, 16 bytes per vertex
+  VERTEX_FORMAT_PROCEDURAL_SPHERE   // No vertex data, vertex.glsl generates a unit sphere from gl_VertexID
+} vertex_format_t;
+
 /**
  * @brief A texture_t contains all the relevant data to a texture in VRAM
  * 
@@ -50,11 +116,140 @@ typedef struct {
 typedef struct {
   GLuint  vbo;            // The vertex buffer storing the raw vertex data
   GLuint  ebo;            // The element buffer storing the primitives
+  GLint   base_vertex;    // The first vertex of the mesh in the vbo (added to every element)
+  GLintptr element_offset;  // The offset of the first element in the ebo (in bytes)
   GLenum  draw_mode;      // The draw mode to use (usually will be GL_TRIANGLES)
   GLsizei vertex_count;   // The number of vertices to be rendered
   GLsizei element_count;  // The number of elements to be rendered
+  GLenum  index_type;     // The type of the elements (GL_UNSIGNED_SHORT or GL_UNSIGNED_INT)
+  vertex_format_t vertex_format;  // The layout of the vertices in the vbo
+  GLfloat position_scale; // What the stored positions have to be scaled by (1 unless packed)
+  GLuint  stacks;         // The stacks of a procedural sphere (0 for other meshes)
+  GLuint  sectors;        // The sectors of a procedural sphere (0 for other meshes)
 } mesh_t;
 
+/**
+ * @brief A mesh_blob_t is the header of a mesh that has been optimized and packed and is ready to be handed to
+ * glBufferData. The vertex data follows the header and the element data follows the vertices. Mesh cache files are
+ * a mesh_blob_t written out as is, so they can be mapped and uploaded without touching the vertices.
+ * 
+ */
+typedef struct {
+  char magic[4];            // "RTSM"
+  uint32_t version;         // MESH_CACHE_VERSION of the code that baked it
+  uint32_t draw_mode;       // The draw mode of the mesh
+  uint32_t index_type;      // The type of the elements
+  uint32_t vertex_format;   // The layout of the vertices
+  uint32_t vertex_count;    // The number of vertices
+  uint32_t element_count;   // The number of elements
+  float position_scale;     // What the stored positions have to be scaled by
+  uint64_t vertex_bytes;    // The size of the vertex data
+  uint64_t element_bytes;   // The size of the element data
+} mesh_blob_t;
+
+/**
+ * @brief A mesh_lod_t is a chain of meshes of the same shape at decreasing levels of detail. Each level records the
+ * largest radius on screen (in pixels) it still looks right at, which is what selectLOD picks with.
+ * 
+ */
+typedef struct {
+  mesh_t levels[MAX_MESH_LODS];     // The meshes, from most to least detailed
+  float max_radius[MAX_MESH_LODS];  // The largest projected radius (in pixels) each level is detailed enough for
+  GLuint count;                     // The number of levels
+} mesh_lod_t;
+
+/**
+ * @brief A geometry_buffer_t is one large vbo and ebo that static meshes are suballocated from, so every mesh can
+ * be drawn from the same vao without rebinding buffers. Meshes are packed one after another and their space is only
+ * given back when the whole buffer is freed.
+ * 
+ */
+typedef struct {
+  GLuint vbo;                     // The vertex buffer every mesh's vertices are in
+  GLuint ebo;                     // The element buffer every mesh's elements are in
+  GLsizeiptr vertex_capacity;     // The size of the vbo (in bytes)
+  GLsizeiptr element_capacity;    // The size of the ebo (in bytes)
+  GLsizeiptr vertex_size;         // How much of the vbo is taken (in bytes)
+  GLsizeiptr element_size;        // How much of the ebo is taken (in bytes)
+} geometry_buffer_t;
+
+/**
+ * @brief An instance_t is the per instance data of an instanced draw. Shaders read it as a mat4 attribute at
+ * INSTANCE_ATTRIBUTE_LOCATION that advances once per instance. Meshes use it as their model matrix, sphere impostors
+ * keep their rotation into view space in the first three columns and their view space center and radius in the last.
+ * 
+ */
+typedef struct {
+  mat4 transform;   // The per instance transform
+} instance_t;
+
+/**
+ * @brief A frame_block_t is the data every draw of a frame shares, laid out like frame_block in the shaders (std140)
+ * 
+ */
+typedef struct {
+  mat4 view_projection;   // The view-projection matrix
+  mat4 projection;        // The projection matrix
+  vec4 sun_position;      // The position of the sun relative to the camera (w is padding)
+  float time;             // The simulation time (in seconds)
+  float padding[3];       // Rounds the block up to 16 bytes like std140 does
+} frame_block_t;
+
+/**
+ * @brief A draw_block_t is the data of one draw call (the instances of one mesh and texture), laid out like
+ * draw_block in the shaders (std140). Transforms stay in the instance buffer.
+ * 
+ */
+typedef struct {
+  GLint sphere_stacks;        // The stacks of the procedural sphere
+  GLint sphere_sectors;       // The sectors of the procedural sphere
+  GLint padding[2];           // Rounds the block up to 16 bytes like std140 does
+} draw_block_t;
+
+/**
+ * @brief A stream_ring_t is a buffer that the data of each frame (instances, draw commands, uniform and shader storage
+ * blocks) is suballocated from front to back, split into STREAM_RING_FRAMES regions that take turns. A fence marks
+ * when the GPU is done with a region's frame, so a region is only written again once its fence has signaled and
+ * nothing ever waits on the driver to copy or rename the buffer. Where GL_ARB_buffer_storage is around the buffer
+ * stays mapped (persistent and coherent) and writes go straight to memory the GPU reads. Otherwise each range is
+ * mapped with glMapBufferRange, unsynchronized since the fence already made sure nothing reads it.
+ * 
+ */
+typedef struct {
+  GLuint buffer;          // The buffer
+  GLsizeiptr frame_size;  // The size of each frame's region (in bytes)
+  GLint alignment;        // Every range starts on a multiple of it (so it can back uniform and shader storage blocks)
+  GLuint frame;           // The region of the current frame
+  GLintptr head;          // Where the next range starts
+  GLsync fences[STREAM_RING_FRAMES];  // Signaled when the GPU is done with each region's last frame
+  unsigned char *mapping; // The whole buffer if it is persistently mapped, NULL otherwise
+  GLuint stalls;          // Frames that had to wait for the GPU to be done with their region
+} stream_ring_t;
+
+/**
+ * @brief A draw_elements_indirect_command_t is one draw of a multi draw indirect call, laid out the way
+ * glMultiDrawElementsIndirect reads it from GL_DRAW_INDIRECT_BUFFER
+ * 
+ */
+typedef struct {
+  GLuint count;           // The number of elements to draw
+  GLuint instance_count;  // The number of instances to draw
+  GLuint first_index;     // The first element in the ebo (in elements, not bytes)
+  GLint  base_vertex;     // Added to every element
+  GLuint base_instance;   // The first instance in the instance buffer
+} draw_elements_indirect_command_t;
+
+/**
+ * @brief A draw_arrays_indirect_command_t is the glDrawArraysIndirect counterpart to draw_elements_indirect_command_t
+ * 
+ */
+typedef struct {
+  GLuint count;           // The number of vertices to draw
+  GLuint instance_count;  // The number of instances to draw
+  GLuint first;           // The first vertex
+  GLuint base_instance;   // The first instance in the instance buffer
+} draw_arrays_indirect_command_t;
+
 /**
  * @brief An interpol_t stores a current and previous state in order to allow for 
  * easy interpolation between the two with respect to an alpha value
@@ -65,12 +260,23 @@ typedef struct {
   vec3 prev;    // The previous state (duh)
 } interpol_t;
 
+/**
+ * @brief An interpol_quat_t is the orientation counterpart to interpol_t. Interpolating quaternions instead of Euler
+ * angles always takes the short way around and doesn't break when an angle wraps from 360 back to 0 degrees.
+ * 
+ */
+typedef struct {
+  versor curr;  // The current orientation
+  versor prev;  // The previous orientation
+} interpol_quat_t;
+
 /**
  * @brief A renderable_t points contains everything required to draw
  * a piece of geometry at a certain position and texture
  */
 typedef struct {
   mesh_t mesh;          // The mesh for the renderable
+  const mesh_lod_t *lods; // The levels of detail to draw instead of mesh (NULL if there are none)
   texture_t texture;    // The texture of the renderable
   mat4 model_matrix;    // The model matrix for the renderable
 
@@ -80,7 +286,7 @@ typedef struct {
    */
   struct {
     interpol_t position;    // The position vector
-    interpol_t rotation;    // The rotation vector
+    interpol_quat_t orientation;  // The orientation quaternion
     interpol_t scale;       // The scale vector
   } model_fields;
 } renderable_t;
@@ -92,6 +298,8 @@ typedef struct {
  */
 typedef struct {
   mat4 view_projection_matrix;  // The combined view matrix and projection matrix
+  mat4 view_matrix;             // The view matrix on its own
+  mat4 projection_matrix;       // The projection matrix on its own
 
   /**
    * @brief Parameters for building a projection matrix
@@ -115,6 +323,48 @@ typedef struct {
   } view_fields;
 } camera_t;
 
+/**
+ * @brief A pending_program_t is a shader program whose compile and link have been issued but not checked yet.
+ * Nothing asks OpenGL about it until it is finished, so the driver is free to work on it in the background.
+ * 
+ */
+typedef struct {
+  GLuint program;       // The program being linked (0 for none)
+  GLuint shaders[2];    // Its shaders (0 where there is none, or both if it came from the program cache)
+  uint64_t key;         // Its key in the program cache
+  bool cached;          // Whether it goes into the program cache once it is linked
+} pending_program_t;
+
+/**
+ * @brief A shader_variants_t is every permutation of a vertex and fragment shader over a set of feature flags. Each
+ * feature is a #define the shaders test with #ifdef instead of branching on a uniform, and a variant is picked by a
+ * bitmask of its features (bit i for feature_names[i]). Variants can be compiled all at once in the background. A
+ * variant that isn't done yet is drawn with its fallback (the variant with only its required features) meanwhile.
+ * 
+ */
+typedef struct {
+  const char *vertex_shader_path;     // Path to the vertex shader on disk
+  const char *fragment_shader_path;   // Path to the fragment shader on disk
+  const char *const *feature_names;   // The #define of each feature
+  GLuint feature_count;               // The number of features
+  GLuint required_features;           // The features a variant can't be drawn without, even by its fallback
+  void (*setup)(GLuint program);      // Called on each variant once it is linked (NULL for nothing)
+  GLuint programs[1 << MAX_SHADER_FEATURES];  // Each variant by its features (0 until it is ready)
+  pending_program_t pending[1 << MAX_SHADER_FEATURES];  // Each variant still compiling
+} shader_variants_t;
+
+/**
+ * @brief A gl_state_counters_t counts the state changes that went through the state cache since the counters were
+ * last reset. Elided calls are the ones the cache skipped because they wouldn't have changed anything.
+ * 
+ */
+typedef struct {
+  GLuint binds;             // Program, vertex array, buffer and texture binds issued to OpenGL
+  GLuint binds_elided;      // Binds skipped because the object was already bound
+  GLuint uniforms;          // Uniform updates issued to OpenGL
+  GLuint uniforms_elided;   // Uniform updates skipped because the value was unchanged or the uniform is inactive
+} gl_state_counters_t;
+
 
 // FUNCTIONS //
 
@@ -129,6 +379,74 @@ typedef struct {
  */
 extern GLuint compileAndLinkShaderProgram(const char *vertex_shader_path, const char *fragment_shader_path);
 
+/**
+ * @brief Compiles and links a usable shader program with #defines inserted after the #version line of both shaders
+ * 
+ * @param vertex_shader_path    Path to the vertex shader program on disk
+ * @param fragment_shader_path  Path to the fragment shader program on disk
+ * @param defines               Lines of #defines (NULL for none)
+ * @return GLuint   The id of the shader program
+ */
+extern GLuint compileAndLinkShaderVariant(const char *vertex_shader_path, const char *fragment_shader_path,
+  const char *defines);
+
+/**
+ * @brief Set up the variants of a shader (none are compiled yet)
+ * 
+ * @param vertex_shader_path    Path to the vertex shader on disk
+ * @param fragment_shader_path  Path to the fragment shader on disk
+ * @param feature_names         The #define of each feature (at most MAX_SHADER_FEATURES, must outlive the variants)
+ * @param feature_count         The number of features
+ * @param required_features     The features a variant can't be drawn without (the rest are dropped by its fallback)
+ * @param setup                 Called on each variant once it is linked (NULL for nothing)
+ * @return shader_variants_t 
+ */
+extern shader_variants_t buildShaderVariants(const char *vertex_shader_path, const char *fragment_shader_path,
+  const char *const *feature_names, GLuint feature_count, GLuint required_features, void (*setup)(GLuint program));
+
+/**
+ * @brief Get the variant of a shader with the given features. A variant still compiling in the background gives
+ * its fallback instead until it is done, and one that was never started is compiled on the spot. Without
+ * GL_KHR_parallel_shader_compile a started variant is only done once updateShaderVariants has finished it.
+ * 
+ * @param variants 
+ * @param features  A bitmask of features
+ * @return GLuint   The id of the shader program to draw the variant with
+ */
+extern GLuint getShaderVariant(shader_variants_t *variants, GLuint features);
+
+/**
+ * @brief Start compiling every variant of a shader at once without waiting on any of them, fallbacks first. They
+ * are collected by getShaderVariant and updateShaderVariants.
+ * 
+ * @param variants 
+ */
+extern void compileShaderVariants(shader_variants_t *variants);
+
+/**
+ * @brief Collect the variants of a shader that have finished compiling in the background. Meant to be called once
+ * a frame. Without GL_KHR_parallel_shader_compile there is no asking whether one is done, so one variant is
+ * finished per call instead (fallbacks first), waiting on the driver if need be.
+ * 
+ * @param variants 
+ */
+extern void updateShaderVariants(shader_variants_t *variants);
+
+/**
+ * @brief Delete every variant of a shader, compiled or still compiling
+ * 
+ * @param variants 
+ */
+extern void freeShaderVariants(shader_variants_t *variants);
+
+/**
+ * @brief Compiles and links a compute shader program (needs OpenGL 4.3 or GL_ARB_compute_shader)
+ * 
+ * @param compute_shader_path   Path to the compute shader program on disk
+ * @return GLuint   The id of the shader program
+ */
+extern GLuint compileAndLinkComputeProgram(const char *compute_shader_path);
+
 /**
  * @brief Send a vec4 to a uniform in a given shader program
  * 
@@ -138,6 +456,24 @@ extern GLuint compileAndLinkShaderProgram(const char *vertex_shader_path, const
  */
 extern void setUniformVec4(GLuint program, const char *uniform_name, vec4 vector);
 
+/**
+ * @brief Send a vec3 to a uniform in a given shader program
+ * 
+ * @param program
+ * @param uniform_name 
+ * @param vector 
+ */
+extern void setUniformVec3(GLuint program, const char *uniform_name, vec3 vector);
+
+/**
+ * @brief Send a mat3 to a uniform in a given shader program
+ * 
+ * @param program
+ * @param uniform_name 
+ * @param matrix 
+ */
+extern void setUniformMat3(GLuint program, const char *uniform_name, mat3 matrix);
+
 /**
  * @brief Send a mat4 to a uniform in a given shader program
  * 
@@ -156,6 +492,206 @@ extern void setUniformMat4(GLuint program, const char *uniform_name, mat4 matrix
  */
 extern void setUniformInt(GLuint program, const char *uniform_name, int v);
 
+/**
+ * @brief Send an unsigned int to a uniform in a given shader program
+ * 
+ * @param program 
+ * @param uniform_name 
+ * @param v 
+ */
+extern void setUniformUint(GLuint program, const char *uniform_name, GLuint v);
+
+/**
+ * @brief Bind a uniform block of a program to a uniform buffer binding (OpenGL 3.3 shaders can't do it themselves)
+ * 
+ * @param program 
+ * @param block_name 
+ * @param binding 
+ */
+extern void setUniformBlockBinding(GLuint program, const char *block_name, GLuint binding);
+
+/**
+ * @brief Delete a shader program along with the uniform locations cached for it
+ * 
+ * @param program 
+ */
+extern void freeShaderProgram(GLuint program);
+
+// STATE FUNCTIONS //
+
+/**
+ * @brief Make a program current unless it already is
+ * 
+ * @param program 
+ */
+extern void useProgram(GLuint program);
+
+/**
+ * @brief Bind a vertex array unless it is already bound
+ * 
+ * @param vao 
+ */
+extern void bindVertexArray(GLuint vao);
+
+/**
+ * @brief Bind a buffer to a target unless it is already bound there. GL_ELEMENT_ARRAY_BUFFER is part of the bound
+ * vertex array's state, so it is kept for each vertex array (binds to it are always issued for vertex arrays past
+ * the first MAX_CACHED_VERTEX_ARRAYS).
+ * 
+ * @param target 
+ * @param buffer 
+ */
+extern void bindBuffer(GLenum target, GLuint buffer);
+
+/**
+ * @brief Check whether the attributes of the bound vertex array need pointing at a vertex buffer with a layout, and
+ * remember that they are from now on. Attribute pointers are part of the vertex array's state, so this is kept for
+ * each vertex array like GL_ELEMENT_ARRAY_BUFFER.
+ * 
+ * @param buffer    The buffer the attributes read from
+ * @param layout    Whatever the caller tells its vertex layouts apart by
+ * @return bool     Whether the attributes were last pointed at another buffer or layout (the caller points them)
+ */
+extern bool vertexAttributesChanged(GLuint buffer, GLuint layout);
+
+/**
+ * @brief Bind a buffer to an indexed binding point (which also binds it to the generic target)
+ * 
+ * @param target 
+ * @param index 
+ * @param buffer 
+ */
+extern void bindBufferBase(GLenum target, GLuint index, GLuint buffer);
+
+/**
+ * @brief Bind a range of a buffer to an indexed binding point unless it is already bound there (which also binds it
+ * to the generic target). Only uniform buffer ranges are cached.
+ * 
+ * @param target 
+ * @param index 
+ * @param buffer 
+ * @param offset 
+ * @param size 
+ */
+extern void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+
+/**
+ * @brief Bind a 2D texture to a texture unit unless it is already bound there
+ * 
+ * @param unit      The texture unit (0 for GL_TEXTURE0)
+ * @param texture 
+ */
+extern void bindTexture2D(GLuint unit, GLuint texture);
+
+/**
+ * @brief Forget everything the state cache thinks is bound, so the next bind of each kind is issued. Call it after
+ * deleting objects or changing bindings without going through the state cache.
+ * 
+ */
+extern void invalidateGLStateCache(void);
+
+/**
+ * @brief Zero the state cache counters (drawScene does this at the start of every frame)
+ * 
+ */
+extern void resetGLStateCounters(void);
+
+/**
+ * @brief Get the state cache counters since they were last reset
+ * 
+ * @return gl_state_counters_t 
+ */
+extern gl_state_counters_t getGLStateCounters(void);
+
+/**
+ * @brief Send a float to a uniform in a given shader program
+ * 
+ * @param program 
+ * @param uniform_name 
+ * @param v 
+ */
+extern void setUniformFloat(GLuint program, const char *uniform_name, float v);
+
+/**
+ * @brief Send an array of floats to a uniform array in a given shader program
+ * 
+ * @param program 
+ * @param uniform_name 
+ * @param v 
+ * @param count 
+ */
+extern void setUniformFloatArray(GLuint program, const char *uniform_name, const float *v, GLsizei count);
+
+/**
+ * @brief Send an array of vec4s to a uniform array in a given shader program
+ * 
+ * @param program 
+ * @param uniform_name 
+ * @param vectors 
+ * @param count 
+ */
+extern void setUniformVec4Array(GLuint program, const char *uniform_name, const vec4 *vectors, GLsizei count);
+
+// STREAM RING FUNCTIONS //
+
+/**
+ * @brief Create a stream ring, persistently mapped if the driver can
+ * 
+ * @param frame_size  The room for each frame's data (in bytes)
+ * @param alignment   The alignment every range needs (rounded up to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT and
+ *                    GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT)
+ * @return stream_ring_t 
+ */
+extern stream_ring_t createStreamRing(GLsizeiptr frame_size, GLint alignment);
+
+/**
+ * @brief Get the space a range takes in a stream ring, its size rounded up to the ring's alignment
+ * 
+ * @param ring 
+ * @param size      The size of the range
+ * @return GLsizeiptr 
+ */
+extern GLsizeiptr streamRingStride(const stream_ring_t *ring, GLsizeiptr size);
+
+/**
+ * @brief Move a stream ring on to the next frame's region, waiting for the GPU to be done with it if need be
+ * 
+ * @param ring 
+ */
+extern void beginStreamRingFrame(stream_ring_t *ring);
+
+/**
+ * @brief Suballocate a range from the current frame's region of a stream ring and get it ready for writing. It has
+ * to be unmapped before drawing.
+ * 
+ * @param ring 
+ * @param size      The size of the range (in bytes)
+ * @param offset    Where to store the offset of the range in the buffer
+ * @return void*    The range (write only)
+ */
+extern void *mapStreamRing(stream_ring_t *ring, GLsizeiptr size, GLintptr *offset);
+
+/**
+ * @brief Unmap the range last mapped from a stream ring (nothing to do when it is persistently mapped)
+ * 
+ * @param ring 
+ */
+extern void unmapStreamRing(stream_ring_t *ring);
+
+/**
+ * @brief Fence the current frame's region of a stream ring once every command reading it has been issued
+ * 
+ * @param ring 
+ */
+extern void endStreamRingFrame(stream_ring_t *ring);
+
+/**
+ * @brief Delete a stream ring
+ * 
+ * @param ring 
+ */
+extern void freeStreamRing(stream_ring_t *ring);
+
 // TEXTURE FUNCTIONS //
 
 /**
@@ -181,7 +717,8 @@ extern void freeTexture(texture_t *texture);
 
 /**
  * @brief Build a mesh_t object in the shape of a sphere with given radius, stacks,
- * and sectors
+ * and sectors. The mesh is loaded from MESH_CACHE_DIRECTORY if it has been baked
+ * before and is cached there otherwise.
  * 
  * @param radius    The radius of the sphere
  * @param stacks    The number of vertical strips from the top pole to the bottom pole
@@ -191,7 +728,8 @@ extern void freeTexture(texture_t *texture);
 extern mesh_t buildSphereMesh(GLfloat radius, GLuint stacks, GLuint sectors);
 
 /**
- * @brief Build a mesh_t object in the shape of an icosphere with given radius and subdivisions
+ * @brief Build a mesh_t object in the shape of an icosphere with given radius and subdivisions.
+ * The mesh is loaded from MESH_CACHE_DIRECTORY if it has been baked before and is cached there otherwise.
  * 
  * @param radius        The radius of the icosphere
  * @param subdivisions  The number of subdivisions
@@ -200,7 +738,194 @@ extern mesh_t buildSphereMesh(GLfloat radius, GLuint stacks, GLuint sectors);
 extern mesh_t buildIcosphereMesh(GLfloat radius, GLuint subdivisions);
 
 /**
- * @brief Free the memory for a mesh_t object, removing the data from VRAM.
+ * @brief Build a mesh_t object for a unit sphere with the given stacks and sectors that has no vertex or element
+ * data at all. It is drawn with glDrawArrays and vertex.glsl works out the position, normal, and uv of each vertex
+ * from gl_VertexID, with the same layout as buildSphereMesh.
+ * 
+ * @param stacks    The number of vertical strips from the top pole to the bottom pole
+ * @param sectors   The number of horizontal strips along the side of the sphere
+ * @return mesh_t 
+ */
+extern mesh_t buildProceduralSphereMesh(GLuint stacks, GLuint sectors);
+
+/**
+ * @brief Generate the geometry of a sphere (see buildSphereMesh) and bake it into a mesh blob without touching
+ * OpenGL
+ * 
+ * @param radius          The radius of the sphere
+ * @param stacks          The number of vertical strips from the top pole to the bottom pole
+ * @param sectors         The number of horizontal strips along the side of the sphere
+ * @return mesh_blob_t*   The baked mesh (free with free)
+ */
+extern mesh_blob_t *bakeSphereMesh(GLfloat radius, GLuint stacks, GLuint sectors);
+
+/**
+ * @brief Generate the geometry of an icosphere (see buildIcosphereMesh) and bake it into a mesh blob without
+ * touching OpenGL
+ * 
+ * @param radius          The radius of the icosphere
+ * @param subdivisions    The number of subdivisions
+ * @return mesh_blob_t*   The baked mesh (free with free)
+ */
+extern mesh_blob_t *bakeIcosphereMesh(GLfloat radius, GLuint subdivisions);
+
+/**
+ * @brief Get the path of the cache file for a sphere with the given parameters
+ * 
+ * @param dest        Where to write the path
+ * @param size        The size of dest
+ * @param directory   The mesh cache directory
+ * @param radius      The radius of the sphere
+ * @param stacks      The number of stacks
+ * @param sectors     The number of sectors
+ */
+extern void getSphereCachePath(char *dest, size_t size, const char *directory, GLfloat radius, GLuint stacks, GLuint sectors);
+
+/**
+ * @brief Get the path of the cache file for an icosphere with the given parameters
+ * 
+ * @param dest          Where to write the path
+ * @param size          The size of dest
+ * @param directory     The mesh cache directory
+ * @param radius        The radius of the icosphere
+ * @param subdivisions  The number of subdivisions
+ */
+extern void getIcosphereCachePath(char *dest, size_t size, const char *directory, GLfloat radius, GLuint subdivisions);
+
+/**
+ * @brief Write a mesh blob to a cache file. The file is written under a temporary name and renamed into place so a
+ * half written file is never loaded.
+ * 
+ * @param path      The path of the cache file
+ * @param blob      The mesh to write
+ * @return true     If the file was written
+ * @return false    If it couldn't be
+ */
+extern bool saveMeshBlob(const char *path, const mesh_blob_t *blob);
+
+/**
+ * @brief Map a mesh cache file into memory and upload it straight to VRAM
+ * 
+ * @param path      The path of the cache file
+ * @param mesh      Where to store the uploaded mesh
+ * @return true     If the mesh was loaded
+ * @return false    If the file is missing or was baked by a different version or vertex format
+ */
+extern bool loadCachedMesh(const char *path, mesh_t *mesh);
+
+/**
+ * @brief Upload the data of a baked mesh. The mesh is suballocated from the geometry buffer while there is one with
+ * room for it and gets its own vbo and ebo otherwise.
+ * 
+ * @param blob      The baked mesh
+ * @return mesh_t   The mesh in VRAM
+ */
+extern mesh_t uploadMeshBlob(const mesh_blob_t *blob);
+
+/**
+ * @brief Compute the average cache miss ratio (vertices transformed per triangle) of drawing the given triangles
+ * through a FIFO post-transform cache. 0.5 is the best any closed mesh can do and 3 the worst.
+ * 
+ * @param elements        The triangle list
+ * @param element_count   The number of elements (3 per triangle)
+ * @param vertex_count    The number of vertices the elements index
+ * @param cache_size      The number of entries in the cache
+ * @return float          The average number of cache misses per triangle
+ */
+extern float computeACMR(const GLuint *elements, GLsizei element_count, GLsizei vertex_count, GLuint cache_size);
+
+/**
+ * @brief Reorder a triangle list in place so that consecutive triangles reuse recently transformed vertices, using
+ * Tom Forsyth's linear-speed vertex cache optimization
+ * 
+ * @param elements        The triangle list
+ * @param element_count   The number of elements (3 per triangle)
+ * @param vertex_count    The number of vertices the elements index
+ */
+extern void optimizeVertexCache(GLuint *elements, GLsizei element_count, GLsizei vertex_count);
+
+/**
+ * @brief Reorder vertices in place into the order the elements first use them so that vertex fetches walk through
+ * memory linearly, and remap the elements to match. Unused vertices are moved to the end.
+ * 
+ * @param vertices        The vertices
+ * @param vertex_count    The number of vertices
+ * @param elements        The elements
+ * @param element_count   The number of elements
+ */
+extern void optimizeVertexFetch(vertex_t *vertices, GLsizei vertex_count, GLuint *elements, GLsizei element_count);
+
+/**
+ * @brief Optimize a triangle mesh for drawing, running optimizeVertexCache and then optimizeVertexFetch.
+ * Every mesh goes through this before being uploaded to VRAM.
+ * 
+ * @param vertices        The vertices
+ * @param vertex_count    The number of vertices
+ * @param elements        The triangle list
+ * @param element_count   The number of elements (3 per triangle)
+ */
+extern void optimizeMesh(vertex_t *vertices, GLsizei vertex_count, GLuint *elements, GLsizei element_count);
+
+/**
+ * @brief Build a chain of icospheres from the given number of subdivisions down to 0, one level of detail each.
+ * The switching radius for each level is where its flat triangles bulge less than pixel_error pixels away from a
+ * true sphere on screen.
+ * 
+ * @param radius          The radius of the icospheres
+ * @param subdivisions    The number of subdivisions of the most detailed level
+ * @param count           The number of levels (at most MAX_MESH_LODS and subdivisions + 1)
+ * @param pixel_error     The largest error (in pixels) tolerated from flat triangles
+ * @return mesh_lod_t 
+ */
+extern mesh_lod_t buildIcosphereLODs(GLfloat radius, GLuint subdivisions, GLuint count, float pixel_error);
+
+/**
+ * @brief Build a chain of procedural unit spheres (see buildProceduralSphereMesh), halving the stacks each level
+ * and using twice as many sectors as stacks. The switching radii follow buildIcosphereLODs.
+ * 
+ * @param stacks          The number of stacks of the most detailed level
+ * @param count           The number of levels (at most MAX_MESH_LODS, and stacks has to stay at least 3)
+ * @param pixel_error     The largest error (in pixels) tolerated from flat triangles
+ * @return mesh_lod_t 
+ */
+extern mesh_lod_t buildProceduralSphereLODs(GLuint stacks, GLuint count, float pixel_error);
+
+/**
+ * @brief Pick the level of detail to draw a mesh with given its projected radius on screen. Detail is added as soon
+ * as it is needed but only dropped once the radius falls DEFAULT_LOD_HYSTERESIS below the threshold, so objects
+ * hovering around a threshold don't pop back and forth.
+ * 
+ * @param lods            The levels of detail
+ * @param screen_radius   The projected radius of the object in pixels
+ * @param current         The level the object was drawn with last frame (>= lods->count if none)
+ * @return GLuint         The level to draw with
+ */
+extern GLuint selectLOD(const mesh_lod_t *lods, float screen_radius, GLuint current);
+
+/**
+ * @brief Free every level of a mesh_lod_t
+ * 
+ * @param lods 
+ */
+extern void freeMeshLODs(mesh_lod_t *lods);
+
+/**
+ * @brief Create the geometry buffer that uploadMeshBlob suballocates static meshes from
+ * 
+ * @param vertex_capacity   The size of its vbo (in bytes)
+ * @param element_capacity  The size of its ebo (in bytes)
+ */
+extern void initGeometryBuffer(GLsizeiptr vertex_capacity, GLsizeiptr element_capacity);
+
+/**
+ * @brief Free the geometry buffer along with every mesh suballocated from it
+ * 
+ */
+extern void freeGeometryBuffer(void);
+
+/**
+ * @brief Free the memory for a mesh_t object, removing the data from VRAM. The space of a mesh in the geometry
+ * buffer is only given back by freeGeometryBuffer.
  * 
  * @param mesh 
  */
@@ -217,6 +942,27 @@ extern void freeMesh(mesh_t *mesh);
  */
 extern void interpolate(interpol_t state, float alpha, vec3 dest);
 
+/**
+ * @brief Interpolate count states with respect to alpha in one pass. Equivalent to calling interpolate on each state.
+ * 
+ * @param states  The states to interpolate
+ * @param alpha   The value to interpolate by
+ * @param dest    The output vectors (count entries)
+ * @param count   The number of states
+ */
+extern void interpolateStates(const interpol_t *states, float alpha, vec3 *dest, size_t count);
+
+/**
+ * @brief Interpolate count orientations with respect to alpha in one pass. This is a normalized lerp along the
+ * shortest arc, which matches a slerp closely for the small rotations between two physics steps.
+ * 
+ * @param states  The orientations to interpolate
+ * @param alpha   The value to interpolate by
+ * @param dest    The output unit quaternions (count entries)
+ * @param count   The number of states
+ */
+extern void interpolateOrientations(const interpol_quat_t *states, float alpha, versor *dest, size_t count);
+
 // RENDERABLE FUNCTIONS //
 
 /**
@@ -260,4 +1006,28 @@ extern camera_t buildCamera(float fov, float aspect, float z_near, float z_far,
  */
 extern void buildModelMatrix(vec3 position, vec3 pivot, vec3 rotation, vec3 scale, mat4 model_matrix);
 
+/**
+ * @brief Build a unit quaternion out of a rotation in degrees (pitch, yaw, roll). The rotations are applied in the
+ * same order as buildModelMatrix (y, then x, then z).
+ * 
+ * @param rotation      The rotation in degrees (pitch, yaw, roll)
+ * @param orientation   The quaternion to build
+ */
+extern void buildOrientation(vec3 rotation, versor orientation);
+
+/**
+ * @brief Build count model matrices at once out of the position, orientation, scale, and (optionally) pivot of
+ * each object. Each matrix equals translate(position + pivot) * rotate(orientation) * scale(scale) * translate(-pivot)
+ * but is written directly in closed form, four objects at a time when SSE is available.
+ * 
+ * @param positions       The position of each object
+ * @param orientations    The orientation of each object as a unit quaternion
+ * @param scales          The scale of each object
+ * @param pivots          The pivot for rotation and scaling of each object (NULL if every pivot is the origin)
+ * @param model_matrices  The model matrices to build (count entries)
+ * @param count           The number of objects
+ */
+extern void buildModelMatrices(
+  const vec3 *positions, const versor *orientations, const vec3 *scales, const vec3 *pivots, mat4 *model_matrices, size_t count);
+
 #endif
\ No newline at end of file
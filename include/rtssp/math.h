@@ -17,11 +17,30 @@
 
 #include <cglm/cglm.h>
 
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
 
 // DEFINES //
 
 #define DEFAULT_HIGHP_TO_VEC3_SCALE_FACTOR      10000.0f    // Each unit in glm corresponds to 10000 units of highp
 
+// Fixed point positions are stored on a grid of 2^-16 highp units. This keeps the resolution uniform (~1.5e-5 units)
+// everywhere in the solar system while still covering +/- 1.4e14 units (~940 AU if a highp unit is a meter)
+#define FIXED_POINT_FRACTIONAL_BITS             16
+#define FIXED_POINT_STEPS_PER_UNIT              ((double)((int64_t)1 << FIXED_POINT_FRACTIONAL_BITS))
+
+// Sets of bounding spheres at least this big are frustum culled on several threads (one chunk of the set each)
+#define PARALLEL_CULL_THRESHOLD                 65536
+#define MAX_CULL_THREADS                        16
+#define MAX_OCCLUDERS                           8       // The most occluders cullOccludedSpheres takes at once
+
+// radixSortKeys sorts this many bits per pass. Wider digits mean fewer passes, and 11 bits still keeps the histograms
+// (8 KB each) in L1, so the 29 or so differing bits of a render queue key sort in 3 passes
+#define RADIX_SORT_DIGIT_BITS                   11
+#define RADIX_SORT_BUCKETS                      (1 << RADIX_SORT_DIGIT_BITS)
+
 
 // STRUCTS //
 
@@ -36,6 +55,55 @@ typedef struct {
   double z;
 } highp_vec3;
 
+/**
+ * @brief A highp_vec3_soa refers to a span of high precision vectors stored as three separate component arrays
+ * (structure of arrays). The batched highp functions stream through these with SIMD, so prefer them over calling
+ * the single vector functions in a loop. The arrays are owned by the caller.
+ * 
+ */
+typedef struct {
+  double *x;    // The x components
+  double *y;    // The y components
+  double *z;    // The z components
+} highp_vec3_soa;
+
+/**
+ * @brief A fixed_vec3 is an alternative representation for positions that stores each component as a 64 bit integer
+ * count of grid steps (see FIXED_POINT_FRACTIONAL_BITS). Unlike a highp_vec3, whose absolute precision falls off the
+ * further a body is from the origin, a fixed_vec3 has the same precision everywhere. Adding a displacement to one is an
+ * exact integer add, but the displacement has to be rounded to the grid first, so error still builds up over many
+ * steps (at the same rate everywhere). Velocities and accelerations stay in highp_vec3.
+ * 
+ */
+typedef struct {
+  int64_t x;
+  int64_t y;
+  int64_t z;
+} fixed_vec3;
+
+/**
+ * @brief A fixed_vec3_soa refers to a span of fixed point vectors stored as three separate component arrays, the
+ * fixed point counterpart of a highp_vec3_soa. The arrays are owned by the caller.
+ * 
+ */
+typedef struct {
+  int64_t *x;   // The x components
+  int64_t *y;   // The y components
+  int64_t *z;   // The z components
+} fixed_vec3_soa;
+
+/**
+ * @brief A bounding_sphere_soa refers to a span of bounding spheres in rendering coordinates stored as separate
+ * component arrays, so they can be culled several at a time with SIMD. The arrays are owned by the caller.
+ * 
+ */
+typedef struct {
+  float *x;       // The x components of the centers
+  float *y;       // The y components of the centers
+  float *z;       // The z components of the centers
+  float *radius;  // The radii
+} bounding_sphere_soa;
+
 
 // FUNCTIONS //
 
@@ -75,4 +143,223 @@ extern highp_vec3 scaleHighPVector(highp_vec3 v, double scale);
  */
 extern void convertHighPVector(const highp_vec3 *src, vec3 dest, float scale_factor);
 
+// BATCHED FUNCTIONS //
+
+/**
+ * @brief Add count vectors from v1 and v2 together and store them in dest. dest may alias v1 or v2.
+ * 
+ * @param v1 
+ * @param v2 
+ * @param dest 
+ * @param count   The number of vectors in each span
+ */
+extern void addHighPVectorArrays(const highp_vec3_soa *v1, const highp_vec3_soa *v2, const highp_vec3_soa *dest, size_t count);
+
+/**
+ * @brief Scale count vectors in x by a and accumulate them into y (y += a * x)
+ * 
+ * @param a       The scalar
+ * @param x       The vectors to scale
+ * @param y       The vectors to accumulate into
+ * @param count   The number of vectors in each span
+ */
+extern void axpyHighPVectorArrays(double a, const highp_vec3_soa *x, const highp_vec3_soa *y, size_t count);
+
+/**
+ * @brief Linearly interpolate count pairs of vectors, dest = v1 + t * (v2 - v1). dest may alias v1 or v2.
+ * 
+ * @param v1      The vectors at t = 0
+ * @param v2      The vectors at t = 1
+ * @param t       The interpolation factor
+ * @param dest 
+ * @param count   The number of vectors in each span
+ */
+extern void lerpHighPVectorArrays(const highp_vec3_soa *v1, const highp_vec3_soa *v2, double t, const highp_vec3_soa *dest, size_t count);
+
+/**
+ * @brief Convert count high precision vectors to cglm compatible vectors relative to origin, i.e.
+ * dest = (src - origin) / scale_factor. Subtracting in double before narrowing keeps everything near the origin
+ * (usually the camera) precise, no matter how far from the center of the solar system it is.
+ * 
+ * @param src           The high precision vectors
+ * @param origin        The high precision origin to convert relative to
+ * @param dest          The cglm vectors (count entries)
+ * @param scale_factor  The positive scale_factor to use for conversion. Note: MUST BE >= 1
+ * @param count         The number of vectors in the span
+ */
+extern void convertHighPVectorArrayRelative(
+  const highp_vec3_soa *src, const highp_vec3 *origin, vec3 *dest, float scale_factor, size_t count);
+
+/**
+ * @brief Allocate the component arrays for a span of count high precision vectors. Each array is 64 byte aligned.
+ * 
+ * @param count             The number of vectors
+ * @return highp_vec3_soa   The span (arrays are NULL on failure)
+ */
+extern highp_vec3_soa allocHighPVectorArray(size_t count);
+
+/**
+ * @brief Free the component arrays of a span allocated with allocHighPVectorArray
+ * 
+ * @param v 
+ */
+extern void freeHighPVectorArray(highp_vec3_soa *v);
+
+/**
+ * @brief Get the name of the SIMD path the batched highp functions picked for this CPU ("avx512", "avx2" or "scalar")
+ * 
+ * @return const char* 
+ */
+extern const char *getHighPSimdPath(void);
+
+/**
+ * @brief Make the batched highp functions (and culling) use a particular SIMD path instead of the one picked for this
+ * CPU, so the paths can be timed against each other. Not safe while other threads are using them.
+ * 
+ * @param name    "avx512", "avx2" or "scalar"
+ * @return true   If the path was switched to
+ * @return false  If this build or CPU can't run it (the path is left alone)
+ */
+extern bool setHighPSimdPath(const char *name);
+
+// CULLING FUNCTIONS //
+
+/**
+ * @brief Test count bounding spheres against six planes (such as the frustum planes glm_frustum_planes extracts)
+ * and write the indices of the spheres that aren't entirely behind any of them to visible, in increasing order.
+ * A plane is (a, b, c, d) with a unit normal (a, b, c) pointing inwards. A plane that isn't finite culls nothing
+ * (the far plane comes out as NaN when z_far / z_near is too large for floats). Uses the same SIMD path as the
+ * batched highp functions and splits sets of at least PARALLEL_CULL_THRESHOLD spheres across threads.
+ * 
+ * @param planes    The six planes
+ * @param spheres   The bounding spheres
+ * @param visible   Where to write the indices of the visible spheres (room for count entries)
+ * @param count     The number of spheres in the span
+ * @return size_t   The number of visible spheres
+ */
+extern size_t cullBoundingSpheres(const vec4 planes[6], const bounding_sphere_soa *spheres, uint32_t *visible, size_t count);
+
+/**
+ * @brief Remove the spheres hidden behind an occluding sphere, as seen from the origin (the camera), from a list of
+ * sphere indices. A sphere is hidden when it lies entirely inside the silhouette cone of an occluder and none of it
+ * is nearer than the occluder's center, so every ray to it passes through the occluder first. Occluders must be solid
+ * everywhere within their radius (shrink them by any tessellation error) and those around the camera are ignored.
+ * 
+ * @param spheres         The bounding spheres the indices refer to
+ * @param occluders       The occluding spheres (center in xyz, radius in w)
+ * @param occluder_count  The number of occluders (MAX_OCCLUDERS at most)
+ * @param visible         The indices to filter, compacted in place in the same order
+ * @param count           The number of indices
+ * @return size_t         The number of indices left
+ */
+extern size_t cullOccludedSpheres(
+  const bounding_sphere_soa *spheres, const vec4 *occluders, size_t occluder_count, uint32_t *visible, size_t count);
+
+/**
+ * @brief Allocate the component arrays for a span of count bounding spheres. Each array is 64 byte aligned.
+ * 
+ * @param count                   The number of spheres
+ * @return bounding_sphere_soa    The span (arrays are NULL on failure)
+ */
+extern bounding_sphere_soa allocBoundingSphereArray(size_t count);
+
+/**
+ * @brief Free the component arrays of a span allocated with allocBoundingSphereArray
+ * 
+ * @param spheres 
+ */
+extern void freeBoundingSphereArray(bounding_sphere_soa *spheres);
+
+// SORTING FUNCTIONS //
+
+/**
+ * @brief Sort 64 bit keys into increasing order with a least significant digit radix sort, RADIX_SORT_DIGIT_BITS per
+ * pass. Only the bits that differ between keys are sorted by, so keys that leave most of their bits the same sort in
+ * fewer passes (with BMI2 the differing bits are gathered from wherever they are in the key). The sort is stable, so
+ * the lowest bits of the keys can be left out of it when the keys are already in order by them (like an index the keys
+ * were built in order of).
+ * 
+ * @param keys          The keys to sort
+ * @param scratch       Scratch space for count keys
+ * @param count         The number of keys
+ * @param ordered_bits  How many of the lowest bits the keys are already in order by (0 to sort by every bit)
+ */
+extern void radixSortKeys(uint64_t *keys, uint64_t *scratch, size_t count, int ordered_bits);
+
+// FIXED POINT FUNCTIONS //
+
+/**
+ * @brief Convert a high precision vector to the nearest point on the fixed point grid
+ * 
+ * @param v 
+ * @return fixed_vec3 
+ */
+extern fixed_vec3 toFixedVector(highp_vec3 v);
+
+/**
+ * @brief Convert a fixed point vector back to a high precision vector
+ * 
+ * @param v 
+ * @return highp_vec3 
+ */
+extern highp_vec3 fromFixedVector(fixed_vec3 v);
+
+/**
+ * @brief Subtract fixed point vector v2 from v1. The result is exact so this should be used to get the offset
+ * between two far away positions before converting to floating point.
+ * 
+ * @param v1 
+ * @param v2 
+ * @return fixed_vec3 
+ */
+extern fixed_vec3 subtractFixedVectors(fixed_vec3 v1, fixed_vec3 v2);
+
+/**
+ * @brief Drift count fixed point positions along their velocities for a timestep of dt. Each displacement is rounded
+ * to the nearest grid step (ties to even) and then added with integer math. The adds are exact and every SIMD path
+ * rounds the same way, so the result is reproducible, but the rounding is up to half a step off each time. A
+ * displacement must be under 2^51 grid steps (about 3.4e10 units).
+ * 
+ * @param positions   The positions to update
+ * @param velocities  The velocity of each position in highp units per second
+ * @param dt          The timestep in seconds
+ * @param count       The number of positions in each span
+ */
+extern void driftFixedPositions(const fixed_vec3_soa *positions, const highp_vec3_soa *velocities, double dt, size_t count);
+
+/**
+ * @brief Drift count high precision positions along their velocities for a timestep of dt. This is the double
+ * precision counterpart to driftFixedPositions.
+ * 
+ * @param positions   The positions to update
+ * @param velocities  The velocity of each position in highp units per second
+ * @param dt          The timestep in seconds
+ * @param count       The number of positions in each span
+ */
+extern void driftHighPPositions(const highp_vec3_soa *positions, const highp_vec3_soa *velocities, double dt, size_t count);
+
+/**
+ * @brief Converts a fixed point vector to a cglm compatible vector using a positive scale factor.
+ * 
+ * @param src           The fixed point vector source
+ * @param dest          The cglm vector destination
+ * @param scale_factor  The positive scale_factor to use for conversion. Note: MUST BE >= 1
+ */
+extern void convertFixedVector(const fixed_vec3 *src, vec3 dest, float scale_factor);
+
+/**
+ * @brief Allocate the component arrays for a span of count fixed point vectors. Each array is 64 byte aligned.
+ * 
+ * @param count             The number of vectors
+ * @return fixed_vec3_soa   The span (arrays are NULL on failure)
+ */
+extern fixed_vec3_soa allocFixedVectorArray(size_t count);
+
+/**
+ * @brief Free the component arrays of a span allocated with allocFixedVectorArray
+ * 
+ * @param v 
+ */
+extern void freeFixedVectorArray(fixed_vec3_soa *v);
+
 #endif
\ No newline at end of file
@@ -42,6 +42,10 @@
 // Tracks whether the program loop is running or not, default value is true
 extern bool is_running;
 
+// The current size of the default framebuffer in pixels
+extern int framebuffer_width;
+extern int framebuffer_height;
+
 
 // FUNCTIONS //
 
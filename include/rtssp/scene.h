@@ -25,8 +25,47 @@
 #define DEFAULT_CAMERA_Z_NEAR   0.1f
 #define DEFAULT_CAMERA_Z_FAR    10000000.0f
 
+#define DEFAULT_SPHERE_SUBDIVISIONS 5   // 20480 triangles at the most detailed level of the sphere
+#define DEFAULT_SPHERE_LODS         6   // Down to the 20 triangle icosahedron
+#define DEFAULT_LOD_PIXEL_ERROR     0.5f  // Pick the coarsest sphere that stays within half a pixel of round
+
+// Generate the sphere in the vertex shader instead of fetching an optimized icosphere. This frees the sphere's
+// buffers but draws without an index buffer, so no transformed vertex is ever reused.
+#define USE_PROCEDURAL_SPHERES          false
+#define DEFAULT_PROCEDURAL_SPHERE_STACKS 128   // The stacks of the most detailed procedural sphere
+
+// Ray trace bodies drawn with the default sphere on one quad each instead of rasterizing the sphere mesh. Bodies
+// the camera is too close to for the quad to stay in front of the near plane fall back to the mesh.
+#define USE_SPHERE_IMPOSTORS            true
+
+// Draw the batches of indexed meshes with glMultiDrawElementsIndirect where the driver has GL_ARB_multi_draw_indirect
+// and GL_ARB_base_instance (core in OpenGL 4.3), one call per run of batches that share a texture and vertex layout.
+// Otherwise every batch gets its own instanced draw call.
+#define USE_MULTI_DRAW_INDIRECT         true
+
+// Cull bodies drawn with the default sphere against the frustum and pick their level of detail (or impostor) in a
+// compute shader that writes the instance counts of the indirect draws. The CPU only hands it the bodies that
+// survived its own frustum and occlusion culling. Needs multi draw indirect along with GL_ARB_compute_shader, GL_ARB_shader_storage_buffer_object and
+// GL_ARB_shader_image_load_store (core in OpenGL 4.3). The body table's lod, impostor, and screen_radius aren't
+// kept up to date for those bodies.
+#define USE_GPU_CULLING                 true
+#define CULL_WORK_GROUP_SIZE            64    // local_size_x of the culling compute shader
+
+// Skip bodies hidden behind the largest default sphere bodies on screen (up to MAX_OCCLUDERS of them). Each occludes
+// with its inscribed sphere, so non-uniformly scaled ones stay conservative. Occluders are also shrunk by a margin so
+// the sphere's levels of detail, which are only round to within DEFAULT_LOD_PIXEL_ERROR, still cover everything they
+// hide.
+#define USE_OCCLUSION_CULLING           true
+#define MIN_OCCLUDER_PIXELS             16.0f   // The smallest radius on screen (in pixels) worth occluding with
+#define OCCLUDER_PIXEL_MARGIN           1.0f    // How far occluders are shrunk (in pixels)
+
+#define MAX_SCENE_BODIES        1024    // The maximum number of physics objects the scene can hold
+
 #define SCENE_VERTEX_SHADER_DIR     "../res/shaders/scene/vertex.glsl"
 #define SCENE_FRAGMENT_SHADER_DIR   "../res/shaders/scene/fragment.glsl"
+#define IMPOSTOR_VERTEX_SHADER_DIR    "../res/shaders/impostor/vertex.glsl"
+#define IMPOSTOR_FRAGMENT_SHADER_DIR  "../res/shaders/impostor/fragment.glsl"
+#define CULL_COMPUTE_SHADER_DIR       "../res/shaders/cull/compute.glsl"
 
 
 // STRUCTS //
@@ -42,21 +81,55 @@ typedef struct {
   double mass;                // The mass of the object
 } phys_object_t;
 
+/**
+ * @brief The body_table_t stores the per frame state of every physics object added to the scene as a structure of
+ * arrays, so the batched math functions can stream through all of them at once. Index i refers to the same body in
+ * every array.
+ * 
+ */
+typedef struct {
+  size_t count;                   // The number of bodies in the table
+  highp_vec3_soa position;        // The current position of each body in high precision
+  highp_vec3_soa prev_position;   // The position of each body at the previous physics step
+  highp_vec3_soa frame_position;  // Scratch space for the position of each body interpolated for this frame
+  interpol_quat_t *orientation;   // The current and previous orientation of each body
+  interpol_t *scale;              // The current and previous scale of each body
+  vec3 *render_position;          // The camera relative position of each body in rendering coordinates
+  versor *frame_orientation;      // The orientation of each body interpolated for this frame
+  vec3 *frame_scale;              // The scale of each body interpolated for this frame
+  mat4 *model_matrix;             // The model matrix of each body for this frame
+  bounding_sphere_soa bounds;     // The bounding sphere of each body in rendering coordinates for this frame
+  bounding_sphere_soa cpu_bounds; // The bounding spheres of the bodies culled on the CPU packed together (GPU culling)
+  uint32_t *cpu_body;             // The body of each sphere in cpu_bounds
+  uint32_t *visible;              // The bodies culled on the CPU left to draw this frame, in increasing order
+  size_t visible_count;           // The number of bodies culled on the CPU left to draw this frame
+  float *screen_radius;           // The radius of each body on screen (in pixels) for this frame
+  GLuint *lod;                    // The level of detail each body was last drawn with
+  bool *impostor;                 // Whether each body is ray traced on a quad this frame
+  GLuint *mesh_slot;              // The render queue slot of each body's mesh (of the first level with levels of detail)
+  GLuint *texture_slot;           // The render queue slot of each body's texture
+  renderable_t *renderable;       // The renderable of each body
+} body_table_t;
+
 
 // DATA //
 
 // MESHES //
 
-extern mesh_t default_sphere; // The default sphere mesh
+extern mesh_lod_t sphere_lods; // The levels of detail for spheres
+extern mesh_t default_sphere; // The default sphere mesh (the most detailed sphere level)
 
 // CAMERA //
 
 extern camera_t camera;   // The camera for the scene
+extern highp_vec3 camera_position;  // The position of the camera in high precision (the camera sits at the origin of rendering coordinates)
 
 // PHYSICS OBJECTS //
 
 extern phys_object_t sol;   // The sun
 
+extern body_table_t bodies;   // Every physics object in the scene
+
 
 // FUNCTIONS //
 
@@ -77,6 +150,14 @@ extern phys_object_t sol;   // The sun
 extern phys_object_t buildPhysicsObject(
   mesh_t mesh, texture_t texture, highp_vec3 position, highp_vec3 rotation, highp_vec3 scale, double mass);
 
+/**
+ * @brief Add a physics object to the scene's body table so it is updated and drawn with the rest of the scene
+ * 
+ * @param object    The object to add
+ * @return size_t   The index of the object in the body table
+ */
+extern size_t addPhysicsObject(const phys_object_t *object);
+
 // SCENE  FUNCTIONS //
 
 /**
@@ -0,0 +1,140 @@
+/*
+  Culling Compute Shader
+  Author: Joseph St. Pierre
+  Year: 2019
+*/
+
+#version 430 core
+
+layout (local_size_x = 64) in;
+
+// Constants
+#define MAX_MESH_LODS 8   // Same as graphics.h
+#define MAX_OCCLUDERS 8   // Same as math.h
+
+// A body to cull (cull_candidate_t in scene.c)
+struct Candidate {
+  mat4 model_matrix;  // The model matrix of the body, its translation is the camera relative center
+  float radius;       // The radius of the body's bounding sphere
+  uint body;          // The index of the body in the body table
+  uint group;         // The cull group (texture) of the body
+  uint padding;
+};
+
+// The layouts glMultiDrawElementsIndirect and glDrawArraysIndirect read
+struct DrawElementsIndirectCommand {
+  uint count;
+  uint instance_count;
+  uint first_index;
+  int base_vertex;
+  uint base_instance;
+};
+struct DrawArraysIndirectCommand {
+  uint count;
+  uint instance_count;
+  uint first;
+  uint base_instance;
+};
+
+// Buffers
+layout (std430, binding = 0) readonly buffer Candidates { Candidate candidates[]; };
+layout (std430, binding = 1) buffer LODStates { uint lod_states[]; };   // The level of detail of each body last frame
+layout (std430, binding = 2) buffer MeshCommands { DrawElementsIndirectCommand mesh_commands[]; };  // lod_count per group
+layout (std430, binding = 3) buffer ImpostorCommands { DrawArraysIndirectCommand impostor_commands[]; };  // One per group
+layout (std430, binding = 4) writeonly buffer Instances { mat4 instances[]; };
+
+// Uniforms
+uniform uint candidate_count;   // The number of candidates
+uniform vec4 planes[6];         // The frustum planes in rendering coordinates, facing in
+uniform uint occluder_count;    // The number of occluders
+uniform vec4 occluders[MAX_OCCLUDERS];  // The occluding spheres in rendering coordinates (center in xyz, radius in w)
+uniform float focal_length;     // Pixels per unit of tan space
+uniform uint lod_count;         // The number of levels of detail
+uniform float max_radius[MAX_MESH_LODS];      // The largest projected radius each level is detailed enough for
+uniform float position_scale[MAX_MESH_LODS];  // The scale of each level's packed positions
+uniform float lod_hysteresis;   // DEFAULT_LOD_HYSTERESIS
+uniform mat4 view;              // The view matrix
+uniform float z_near;           // The near plane
+uniform int use_impostors;      // Whether spheres may be ray traced on a quad
+
+// Same test as impostorFits in scene.c
+bool impostorFits(vec3 center, float radius) {
+  float distance2 = dot(center, center);
+  if (distance2 <= radius * radius)
+    return false;
+
+  float distance = sqrt(distance2);
+  float half_size = radius * distance / sqrt(distance2 - radius * radius);
+  float w_z = center.z / distance;
+  return -center.z - half_size * sqrt(2.0f * (1.0f - w_z * w_z)) > z_near;
+}
+
+// Same test as cullOccludedSpheres in math.c
+bool occluded(vec3 center, float radius) {
+  float distance = length(center);
+  if (distance <= radius)
+    return false;
+
+  float sin_span = radius / distance;
+  float cos_span = sqrt(1.0f - sin_span * sin_span);
+  for (uint o = 0u; o < occluder_count; o++) {
+    float occluder_distance = length(occluders[o].xyz);
+    float occluder_radius = occluders[o].w;
+    if (occluder_radius <= 0.0f || occluder_distance <= occluder_radius)
+      continue;   // Occluders around the camera are ignored
+
+    float sin_angle = occluder_radius / occluder_distance;
+    float cos_angle = sqrt(1.0f - sin_angle * sin_angle);
+    if (sin_span <= sin_angle && distance - radius >= occluder_distance &&
+      dot(center, occluders[o].xyz / occluder_distance) >= distance * (cos_angle * cos_span + sin_angle * sin_span))
+      return true;
+  }
+  return false;
+}
+
+void main() {
+  uint i = gl_GlobalInvocationID.x;
+  if (i >= candidate_count)
+    return;
+  Candidate candidate = candidates[i];
+  vec3 center = candidate.model_matrix[3].xyz;
+  float radius = candidate.radius;
+
+  // Skip spheres entirely outside one of the frustum planes
+  for (int p = 0; p < 6; p++) {
+    if (dot(planes[p].xyz, center) + planes[p].w < -radius)
+      return;
+  }
+
+  // Then spheres hidden behind an occluder
+  if (occluded(center, radius))
+    return;
+
+  // Same level of detail selection as selectLOD in graphics.c
+  float distance2 = dot(center, center);
+  float screen_radius = distance2 > radius * radius ? focal_length * radius / sqrt(distance2 - radius * radius) : 3.4e38f;
+  uint lod = min(lod_states[candidate.body], lod_count - 1u);
+  while (lod > 0u && screen_radius > max_radius[lod])
+    lod--;
+  while (lod + 1u < lod_count && screen_radius < max_radius[lod + 1u] * (1.0f - lod_hysteresis))
+    lod++;
+  lod_states[candidate.body] = lod;
+
+  // Append the body to the impostors or to its level of detail
+  vec3 view_center = (view * vec4(center, 1.0f)).xyz;
+  if (use_impostors != 0 && impostorFits(view_center, radius)) {
+    // The rotation into view space, then the view space center and radius (see buildImpostorInstance)
+    mat3 scaled = mat3(candidate.model_matrix);
+    mat3 object_to_view = mat3(view) * mat3(normalize(scaled[0]), normalize(scaled[1]), normalize(scaled[2]));
+    uint slot = atomicAdd(impostor_commands[candidate.group].instance_count, 1u);
+    instances[impostor_commands[candidate.group].base_instance + slot] =
+      mat4(vec4(object_to_view[0], 0.0f), vec4(object_to_view[1], 0.0f), vec4(object_to_view[2], 0.0f), vec4(view_center, radius));
+  }
+  else {
+    uint command = candidate.group * lod_count + lod;
+    uint slot = atomicAdd(mesh_commands[command].instance_count, 1u);
+    mat4 scale = mat4(position_scale[lod]);
+    scale[3][3] = 1.0f;
+    instances[mesh_commands[command].base_instance + slot] = candidate.model_matrix * scale;
+  }
+}
@@ -0,0 +1,65 @@
+/*
+  Sphere Impostor Fragment Shader
+  Author: Joseph St. Pierre
+  Year: 2019
+*/
+
+#version 330 core
+
+// Features (defined by the variant, see impostor_features in scene.c)
+//   USE_TEXTURE         Sample diffuse_map instead of drawing white
+
+// Outputs
+layout (location = 0) out vec4 fragment_color;
+
+// Inputs
+in vec3 f_view_position;
+flat in vec3 f_center;          // The center of the sphere in view space
+flat in float f_radius;         // The radius of the sphere
+flat in mat3 f_view_to_object;  // Rotates view space directions into the sphere's own space
+
+// Uniforms
+layout (std140) uniform frame_block {   // frame_block_t in graphics.h
+  mat4 view_projection;   // The view-projection matrix
+  mat4 projection;        // The projection matrix
+  vec4 sun_position;      // The position of the sun relative to the camera
+  float time;             // The simulation time (in seconds)
+};
+#ifdef USE_TEXTURE
+uniform sampler2D diffuse_map;
+#endif
+
+// Constants
+const float PI = 3.14159265358979f;
+
+void main() {
+  // Intersect the ray from the camera through this fragment with the sphere. Rays that miss are discarded at the
+  // end so the derivatives below are still taken across the whole quad.
+  vec3 direction = normalize(f_view_position);
+  float b = dot(direction, f_center);
+  float c = dot(f_center, f_center) - f_radius * f_radius;
+  float h = b * b - c;
+  vec3 hit = direction * (b - sqrt(max(h, 0.0f)));
+
+  // Same uv mapping as the sphere meshes. u in [0, 1) jumps at +x and u in [-0.5, 0.5) jumps at -x, so each seam
+  // uses the one that doesn't jump there and the derivatives never pick the smallest mip. The margin keeps rounding
+  // from flipping between the two everywhere else.
+  vec3 normal = f_view_to_object * ((hit - f_center) / f_radius);
+  float u = atan(normal.y, normal.x) / (2.0f * PI);
+  float u_wrapped = fract(u);
+  float v = acos(clamp(normal.z, -1.0f, 1.0f)) / PI;
+  vec2 uv = vec2(fwidth(u_wrapped) > fwidth(u) + 0.25f ? u : u_wrapped, v);
+
+#ifdef USE_TEXTURE
+  fragment_color = texture(diffuse_map, uv);  // Sample from the diffuse_map
+#else
+  fragment_color = vec4(1.0f, 1.0f, 1.0f, 1.0f);  // If no texture, just draw white fragments
+#endif
+
+  if (h < 0.0f)
+    discard;  // The ray misses the sphere
+
+  // Write the depth of the hit instead of the quad's
+  vec4 clip = projection * vec4(hit, 1.0f);
+  gl_FragDepth = 0.5f * (clip.z / clip.w) + 0.5f;
+}
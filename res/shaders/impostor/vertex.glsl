@@ -0,0 +1,48 @@
+/*
+  Sphere Impostor Vertex Shader
+  Author: Joseph St. Pierre
+  Year: 2019
+*/
+
+#version 330 core
+
+// Inputs
+layout (location = 3) in mat4 instance;   // The sphere's rotation into view space, then its view space center and radius
+
+// Outputs
+out vec3 f_view_position;   // The point on the quad in view space (the ray from the camera goes through it)
+flat out vec3 f_center;     // The center of the sphere in view space
+flat out float f_radius;    // The radius of the sphere
+flat out mat3 f_view_to_object;   // Rotates view space directions into the sphere's own space
+
+// Uniforms
+layout (std140) uniform frame_block {   // frame_block_t in graphics.h
+  mat4 view_projection;   // The view-projection matrix
+  mat4 projection;        // The projection matrix
+  vec4 sun_position;      // The position of the sun relative to the camera
+  float time;             // The simulation time (in seconds)
+};
+
+// The corners of the quad as a triangle strip
+const vec2 QUAD_CORNERS[4] = vec2[4](vec2(-1.0f, -1.0f), vec2(1.0f, -1.0f), vec2(-1.0f, 1.0f), vec2(1.0f, 1.0f));
+
+void main() {
+  vec3 center = instance[3].xyz;
+  float radius = instance[3].w;
+  f_center = center;
+  f_radius = radius;
+  f_view_to_object = transpose(mat3(instance));   // The inverse of a rotation
+
+  // Face the quad towards the camera through the center of the sphere
+  float distance = length(center);
+  vec3 w = center / distance;
+  vec3 u = normalize(cross(w, abs(w.y) < 0.99f ? vec3(0.0f, 1.0f, 0.0f) : vec3(1.0f, 0.0f, 0.0f)));
+  vec3 v = cross(u, w);
+
+  // Size it to the cone of rays that touch the sphere where the cone crosses the center
+  float half_size = radius * distance / sqrt(distance * distance - radius * radius);
+
+  vec2 corner = QUAD_CORNERS[gl_VertexID];
+  f_view_position = center + (corner.x * u + corner.y * v) * half_size;
+  gl_Position = projection * vec4(f_view_position, 1.0f);
+}
@@ -6,6 +6,9 @@
 
 #version 330 core
 
+// Features (defined by the variant, see scene_features in scene.c)
+//   USE_TEXTURE         Sample diffuse_map instead of drawing white
+
 // Outputs
 layout (location = 0) out vec4 fragment_color;
 
@@ -14,13 +17,14 @@ in vec3 f_normal;
 in vec2 f_uv;
 
 // Uniforms
-uniform int use_texture;
+#ifdef USE_TEXTURE
 uniform sampler2D diffuse_map;
+#endif
 
 void main() {
-  // If no texture, just draw white fragments
-  if (use_texture == 0)
-    fragment_color = vec4(1.0f, 1.0f, 1.0f, 1.0f);
-  else
-    fragment_color = texture(diffuse_map, f_uv);  // Sample from the diffuse_map
+#ifdef USE_TEXTURE
+  fragment_color = texture(diffuse_map, f_uv);  // Sample from the diffuse_map
+#else
+  fragment_color = vec4(1.0f, 1.0f, 1.0f, 1.0f);  // If no texture, just draw white fragments
+#endif
 }
@@ -6,22 +6,77 @@
 
 #version 330 core
 
+// Features (defined by the variant, see scene_features in scene.c)
+//   OCTAHEDRAL_NORMALS  The normals are packed with the octahedral mapping
+//   PROCEDURAL_SPHERE   Generate a unit sphere from gl_VertexID instead of reading attributes
+
 // Inputs
 layout (location = 0) in vec3 position;   // The vertex position
-layout (location = 1) in vec3 normal;     // The vertex normal
+layout (location = 1) in vec3 normal;     // The vertex normal (an octahedral pair in xy if OCTAHEDRAL_NORMALS)
 layout (location = 2) in vec2 uv;         // The vertex texture coords
+layout (location = 3) in mat4 model_matrix;   // The model matrix of the instance (scaled up for packed positions)
 
 // Outputs
 out vec3 f_normal;    // Output fragment normal vector
 out vec2 f_uv;        // Output fragment texture coords
 
 // Uniforms
-uniform mat4 MVP;   // The model-view-projection matrix
+layout (std140) uniform frame_block {   // frame_block_t in graphics.h
+  mat4 view_projection;   // The view-projection matrix
+  mat4 projection;        // The projection matrix
+  vec4 sun_position;      // The position of the sun relative to the camera
+  float time;             // The simulation time (in seconds)
+};
+#ifdef PROCEDURAL_SPHERE
+layout (std140) uniform draw_block {    // draw_block_t in graphics.h
+  int sphere_stacks;      // The stacks of the procedural sphere
+  int sphere_sectors;     // The sectors of the procedural sphere
+};
+
+// Constants
+const float PI = 3.14159265358979f;
+
+// The (stack, sector) corners of the two triangles of a quad, wound like buildSphereMesh
+const ivec2 QUAD_CORNERS[6] = ivec2[6](
+  ivec2(0, 0), ivec2(1, 0), ivec2(0, 1),
+  ivec2(0, 1), ivec2(1, 0), ivec2(1, 1)
+);
+#endif
+
+#ifdef OCTAHEDRAL_NORMALS
+// Unfold an octahedral encoded normal (see encodeOctahedral in graphics.c)
+vec3 decodeOctahedral(vec2 e) {
+  vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+  float t = max(-n.z, 0.0f);
+  n.x += n.x >= 0.0f ? -t : t;
+  n.y += n.y >= 0.0f ? -t : t;
+  return normalize(n);
+}
+#endif
 
 void main() {
-  gl_Position = MVP * vec4(position, 1.0f);   // Compute the vertex position
+#ifdef PROCEDURAL_SPHERE
+  // Find the grid corner of this vertex, 6 vertices per quad
+  int quad = gl_VertexID / 6;
+  ivec2 corner = ivec2(quad / sphere_sectors, quad % sphere_sectors) + QUAD_CORNERS[gl_VertexID % 6];
+
+  // Same angles as buildSphereMesh, the normal of a unit sphere is its position
+  float stack_angle = PI / 2.0f - PI * float(corner.x) / float(sphere_stacks);
+  float sector_angle = 2.0f * PI * float(corner.y) / float(sphere_sectors);
+  vec3 vertex_position = vec3(cos(stack_angle) * cos(sector_angle), cos(stack_angle) * sin(sector_angle), sin(stack_angle));
+  f_normal = vertex_position;
+  f_uv = vec2(corner.y, corner.x) / vec2(sphere_sectors, sphere_stacks);
+#else
+  vec3 vertex_position = position;
 
   // Forward normal vector and uv coords to the fragment shader
+#ifdef OCTAHEDRAL_NORMALS
+  f_normal = decodeOctahedral(normal.xy);
+#else
   f_normal = normal;
+#endif
   f_uv = uv;
+#endif
+
+  gl_Position = view_projection * (model_matrix * vec4(vertex_position, 1.0f));   // Compute the vertex position
 }
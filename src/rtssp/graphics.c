@@ -19,41 +19,122 @@
 
 #include <math.h>
 #include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 // DEFINITIONS //
 
 #define LOG_SIZE 512    // Allocate 512 bytes to error logs from OpenGL
 
+// Tuning of the Forsyth vertex cache optimization (the values from his article)
+#define FORSYTH_CACHE_SIZE          32      // The size of the LRU cache the optimization models
+#define FORSYTH_CACHE_DECAY_POWER   1.5f    // How fast the score drops off towards the back of the cache
+#define FORSYTH_LAST_TRIANGLE_SCORE 0.75f   // The score of the vertices of the triangle just added
+#define FORSYTH_VALENCE_BOOST_SCALE 2.0f    // How much vertices with few triangles left are favoured
+#define FORSYTH_VALENCE_BOOST_POWER 0.5f
+
+#define STREAM_RING_WAIT_NS 1000000000  // How long a stream ring waits on a fence before checking it again
+#define UNKNOWN_BINDING UINT32_MAX  // What the state cache holds for a binding it doesn't know (never a valid name)
+
+
+// LOCAL DATA //
+
+/**
+ * @brief A buffer_range_t is a range of a buffer bound to an indexed binding point
+ * 
+ */
+typedef struct {
+  GLuint buffer;        // The buffer
+  GLintptr offset;      // The start of the range (in bytes)
+  GLsizeiptr size;      // The size of the range (in bytes)
+} buffer_range_t;
+
+/**
+ * @brief A vertex_array_state_t is the part of a vertex array's state the state cache keeps track of
+ * 
+ */
+typedef struct {
+  GLuint vao;                   // The vertex array (0 for an empty slot)
+  GLuint element_array_buffer;  // Its GL_ELEMENT_ARRAY_BUFFER
+  GLuint vertex_buffer;         // The buffer its attributes were last pointed at
+  GLuint vertex_layout;         // The layout they were pointed with (see vertexAttributesChanged)
+} vertex_array_state_t;
+
+/**
+ * @brief A gl_state_t is what the state cache last bound. Zero matches a freshly created context.
+ * 
+ */
+typedef struct {
+  GLuint program;               // The current program
+  GLuint vao;                   // The bound vertex array
+  vertex_array_state_t *vertex_array;   // The state kept for it (NULL if it has no slot)
+  vertex_array_state_t vertex_arrays[MAX_CACHED_VERTEX_ARRAYS];  // The state kept for each vertex array bound
+  GLuint array_buffer;          // GL_ARRAY_BUFFER
+  GLuint copy_write_buffer;     // GL_COPY_WRITE_BUFFER
+  GLuint draw_indirect_buffer;  // GL_DRAW_INDIRECT_BUFFER
+  GLuint shader_storage_buffer; // GL_SHADER_STORAGE_BUFFER (the generic binding, not the indexed ones)
+  GLuint uniform_buffer;        // GL_UNIFORM_BUFFER (the generic binding)
+  buffer_range_t uniform_ranges[MAX_UNIFORM_BUFFER_BINDINGS];   // The indexed GL_UNIFORM_BUFFER bindings
+  GLuint active_texture;        // The active texture unit (0 for GL_TEXTURE0)
+  GLuint textures[MAX_TEXTURE_UNITS];  // The GL_TEXTURE_2D bound to each unit
+} gl_state_t;
+
+/**
+ * @brief A cached_uniform_t is a slot of the uniform cache, an open addressing hash table from a program and
+ * uniform name to the uniform's location and last value
+ * 
+ */
+typedef struct {
+  GLuint program;               // The program the uniform belongs to (0 for an empty slot)
+  GLint location;               // Its location, resolved when the program was linked
+  GLsizei value_size;           // The size of the cached value in bytes (0 while nothing is cached)
+  char name[UNIFORM_NAME_SIZE]; // The name the uniform is set through
+  unsigned char value[UNIFORM_VALUE_SIZE];  // The value last sent to OpenGL
+} cached_uniform_t;
+
+/**
+ * @brief A program_blob_t is the header of a program cache file, the binary glGetProgramBinary gave back follows it
+ * 
+ */
+typedef struct {
+  char magic[4];          // "RTSP"
+  uint32_t version;       // PROGRAM_CACHE_VERSION of the code that wrote it
+  uint64_t key;           // The hash of the sources and driver the program was linked from
+  uint32_t format;        // The format of the binary
+  uint32_t binary_bytes;  // The size of the binary
+} program_blob_t;
+
+static geometry_buffer_t geometry_buffer;   // Where static meshes are suballocated from (vbo is 0 until initialized)
+static gl_state_t gl_state;                 // What the state cache believes is bound
+static cached_uniform_t uniform_cache[MAX_CACHED_UNIFORMS];  // The uniforms of every linked program
+static gl_state_counters_t gl_state_counters;   // Calls issued and elided since the last reset
+
 
 // LOCAL FUNCTIONS //
 
 // SHADER FUNCTIONS //
 
 /**
- * @brief Local helper function for compiling a shader program
+ * @brief Local helper function for reading the source of a shader from disk
  * 
  * @param shader_path   Path to the shader program on disk
- * @param type          The type of program to compile
- * @return GLuint       Id of the shader
+ * @return char*        The source, null terminated (free it once done)
  */
-static GLuint compileShader(const char *shader_path, GLenum type) {
+static char *readShaderSource(const char *shader_path) {
   // Assertions
   assert(shader_path);  // Shader path must not be null
 
   // Fields
-  GLuint shader;    // The shader to be compiled
-  GLint success;    // Success flag
-  GLchar error_log[LOG_SIZE];  // Allocate log size bytes for error logs
   FILE *file = NULL;  // The file pointer for loading the shader code from disk
   char *buffer = NULL;  // The buffer to be filled with the text of the source files
   long length;  // The length of the buffer
 
-  /**
-   * @brief Here we load and compile the shader
-   * 
-   */
-
   // FILE IO //
   file = fopen(shader_path, "r");  // The path to the shader
   assert(file); // Ensure file loaded properly
@@ -67,88 +148,1423 @@ static GLuint compileShader(const char *shader_path, GLenum type) {
   // Read data into buffer
   fread(buffer, 1, length, file);
 
-  // Close the file
-  fclose(file);
+  // Close the file
+  fclose(file);
+
+  buffer[length] = '\0';  // Add the null terminator
+
+  return buffer;
+}
+
+/**
+ * @brief Local helper function for issuing the compile of a shader. Whether it compiled isn't asked until the
+ * program it goes into is finished, so the driver doesn't have to be done with it before this returns.
+ * 
+ * @param source        The source of the shader
+ * @param type          The type of program to compile
+ * @param defines       Lines of #defines to insert right after the #version line (NULL for none)
+ * @return GLuint       Id of the shader
+ */
+static GLuint issueShader(const char *source, GLenum type, const char *defines) {
+  // Assertions
+  assert(source);  // Source must not be null
+
+  // Fields
+  GLuint shader;    // The shader to be compiled
+
+  // #defines have to come after the #version line, which has to come first (but for comments)
+  const char *body = source;
+  GLint body_line = 1;    // The line of the file the body starts on
+  const char *version = strstr(source, "#version");
+  if (version) {
+    body = strchr(version, '\n');
+    body = body ? body + 1 : source + strlen(source);
+    for (const char *c = source; c < body; c++)
+      body_line += *c == '\n';
+  }
+
+  // Number the lines after the defines like the file does so errors point at the right line
+  char line_directive[32];
+  snprintf(line_directive, sizeof(line_directive), "#line %d\n", body_line);
+  const GLchar *sources[] = {source, defines ? defines : "", line_directive, body};
+  const GLint lengths[] = {(GLint)(body - source), -1, -1, -1};
+
+  // Build requested shader program
+  shader = glCreateShader(type);
+  glShaderSource(shader, 4, sources, lengths);
+  glCompileShader(shader);
+
+  return shader;    // Return the shader
+}
+
+/**
+ * @brief Local helper function for checking whether the driver compiles and links on threads of its own, and
+ * letting it use as many as it likes the first time
+ * 
+ * @return true   If whether a program is done can be asked without waiting on it (GL_COMPLETION_STATUS_KHR)
+ * @return false  If asking anything about a program waits until it is linked
+ */
+static bool parallelCompileAvailable(void) {
+  static bool threads_set = false;
+  if (!USE_PARALLEL_SHADER_COMPILE || !GLAD_GL_KHR_parallel_shader_compile)
+    return false;
+  if (!threads_set) {
+    glMaxShaderCompilerThreadsKHR(0xFFFFFFFFu);  // No limit, the driver picks
+    threads_set = true;
+  }
+  return true;
+}
+
+/**
+ * @brief Local helper function for checking whether linked programs can be cached on disk, which takes
+ * GL_ARB_get_program_binary and a driver with at least one binary format
+ * 
+ * @return true   If programs are cached
+ * @return false  If every program is compiled from source
+ */
+static bool programCacheAvailable(void) {
+  static GLint format_count = -1;   // Asked for once
+  if (!USE_PROGRAM_CACHE || !GLAD_GL_ARB_get_program_binary)
+    return false;
+  if (format_count < 0)
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+  return format_count > 0;
+}
+
+/**
+ * @brief Local helper function for hashing the sources of a program and the driver it is linked by into the key of
+ * its cache file (FNV-1a). A binary only loads on the driver that made it, so a new driver misses the cache instead
+ * of failing to load.
+ * 
+ * @param sources       The source of each shader
+ * @param source_count  The number of shaders
+ * @param defines       The #defines inserted into each shader (NULL for none)
+ * @return uint64_t     The key
+ */
+static uint64_t hashProgramSources(const char *const *sources, size_t source_count, const char *defines) {
+  const char *driver[] = {
+    defines, (const char *)glGetString(GL_VENDOR), (const char *)glGetString(GL_RENDERER),
+    (const char *)glGetString(GL_VERSION)
+  };
+
+  uint64_t hash = 14695981039346656037ull ^ PROGRAM_CACHE_VERSION;
+  for (size_t s = 0; s < source_count + 4; s++) {
+    const char *c = s < source_count ? sources[s] : driver[s - source_count];
+    for (c = c ? c : ""; ; c++) {
+      hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+      if (*c == '\0')
+        break;  // Hashing the terminator too keeps "ab" "c" apart from "a" "bc"
+    }
+  }
+  return hash;
+}
+
+/**
+ * @brief Local helper function for finding the path of a program cache file
+ * 
+ * @param dest  Where to write the path
+ * @param size  The size of dest
+ * @param key   The key of the program
+ */
+static void getProgramCachePath(char *dest, size_t size, uint64_t key) {
+  snprintf(dest, size, "%s/program-%016llx.bin", PROGRAM_CACHE_DIRECTORY, (unsigned long long)key);
+}
+
+/**
+ * @brief Local helper function for loading a program linked on an earlier run from the program cache
+ * 
+ * @param key       The key of the program
+ * @return GLuint   The linked program (0 if it isn't cached or the driver won't take the binary)
+ */
+static GLuint loadCachedProgram(uint64_t key) {
+  char path[PROGRAM_CACHE_PATH_SIZE];
+  getProgramCachePath(path, sizeof(path), key);
+
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return 0;   // Not cached yet
+
+  // Only use it if it was written by this version of the code for this program
+  program_blob_t header;
+  void *binary = NULL;
+  bool valid = fread(&header, sizeof(program_blob_t), 1, file) == 1 && !memcmp(header.magic, "RTSP", 4) &&
+    header.version == PROGRAM_CACHE_VERSION && header.key == key && header.binary_bytes > 0;
+  if (valid) {
+    binary = malloc(header.binary_bytes);
+    assert(binary);
+    valid = fread(binary, 1, header.binary_bytes, file) == header.binary_bytes;
+  }
+  fclose(file);
+
+  GLuint program = 0;
+  if (valid) {
+    // The driver can still turn it down (it was updated without its version string changing, say)
+    program = glCreateProgram();
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glProgramBinary(program, header.format, binary, (GLsizei)header.binary_bytes);
+
+    GLint success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+      glDeleteProgram(program);
+      program = 0;
+    }
+  }
+  free(binary);
+
+  return program;
+}
+
+/**
+ * @brief Local helper function for writing a linked program to the program cache. Not being able to cache it isn't
+ * an error, it is just linked from source again next time.
+ * 
+ * @param key       The key of the program
+ * @param program   The linked program (linked with GL_PROGRAM_BINARY_RETRIEVABLE_HINT set)
+ */
+static void saveCachedProgram(uint64_t key, GLuint program) {
+  GLint binary_bytes = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binary_bytes);
+  if (binary_bytes <= 0)
+    return;
+
+  // Fill in the header and get the binary right after it
+  program_blob_t *blob = (program_blob_t *)malloc(sizeof(program_blob_t) + binary_bytes);
+  assert(blob);
+  memcpy(blob->magic, "RTSP", 4);
+  blob->version = PROGRAM_CACHE_VERSION;
+  blob->key = key;
+  GLenum format;
+  GLsizei length = 0;
+  glGetProgramBinary(program, binary_bytes, &length, &format, blob + 1);
+  blob->format = format;
+  blob->binary_bytes = (uint32_t)length;
+
+  // Write it next to where it goes and move it into place, so a half written file is never loaded
+  char path[PROGRAM_CACHE_PATH_SIZE], temp_path[PROGRAM_CACHE_PATH_SIZE + 4];
+  getProgramCachePath(path, sizeof(path), key);
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+  FILE *file = length > 0 ? fopen(temp_path, "wb") : NULL;
+  if (file) {
+    size_t size = sizeof(program_blob_t) + (size_t)length;
+    bool written = fwrite(blob, 1, size, file) == size;
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temp_path, path) != 0)
+      remove(temp_path);
+  }
+
+  free(blob);
+}
+
+/**
+ * @brief Local helper function for hashing a uniform into the uniform cache (FNV-1a seeded with the program)
+ * 
+ * @param program 
+ * @param name 
+ * @return GLuint   The slot to start probing from
+ */
+static GLuint hashUniform(GLuint program, const char *name) {
+  uint32_t hash = 2166136261u ^ program;
+  for (; *name; name++)
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
+  return hash & (MAX_CACHED_UNIFORMS - 1);
+}
+
+/**
+ * @brief Local helper function for finding a uniform in the uniform cache
+ * 
+ * @param program 
+ * @param name 
+ * @return cached_uniform_t*    The slot of the uniform, or NULL if the program has no such active uniform
+ */
+static cached_uniform_t *findUniform(GLuint program, const char *name) {
+  GLuint slot = hashUniform(program, name);
+  for (GLuint probes = 0; probes < MAX_CACHED_UNIFORMS; probes++) {
+    cached_uniform_t *uniform = &uniform_cache[slot];
+    if (uniform->program == 0)
+      return NULL;  // Hit an empty slot, it isn't in the table
+    if (uniform->program == program && strcmp(uniform->name, name) == 0)
+      return uniform;
+    slot = (slot + 1) & (MAX_CACHED_UNIFORMS - 1);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Local helper function for adding a uniform to the uniform cache
+ * 
+ * @param program 
+ * @param name 
+ * @param location 
+ */
+static void insertUniform(GLuint program, const char *name, GLint location) {
+  assert(strlen(name) < UNIFORM_NAME_SIZE);
+
+  GLuint slot = hashUniform(program, name);
+  for (GLuint probes = 0; probes < MAX_CACHED_UNIFORMS; probes++) {
+    cached_uniform_t *uniform = &uniform_cache[slot];
+    if (uniform->program == 0) {
+      uniform->program = program;
+      uniform->location = location;
+      uniform->value_size = 0;
+      strcpy(uniform->name, name);
+      return;
+    }
+    slot = (slot + 1) & (MAX_CACHED_UNIFORMS - 1);
+  }
+
+  fprintf(stderr, "The uniform cache is full, raise MAX_CACHED_UNIFORMS\n");
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Local helper function for resolving the locations of every active uniform of a freshly linked program, so
+ * setting a uniform never has to ask OpenGL for its location
+ * 
+ * @param program 
+ */
+static void cacheUniformLocations(GLuint program) {
+  GLint count = 0;
+  glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+  for (GLint i = 0; i < count; i++) {
+    char name[UNIFORM_NAME_SIZE];
+    GLsizei length = 0;
+    GLint size;
+    GLenum type;
+    glGetActiveUniform(program, (GLuint)i, UNIFORM_NAME_SIZE, &length, &size, &type, name);
+
+    // Arrays are reported as name[0] but set through their plain name
+    if (length > 3 && strcmp(name + length - 3, "[0]") == 0)
+      name[length - 3] = '\0';
+
+    GLint location = glGetUniformLocation(program, name);
+    if (location >= 0)    // Members of uniform blocks have no location
+      insertUniform(program, name, location);
+  }
+}
+
+/**
+ * @brief Local helper function for starting a shader program. It is loaded from the program cache if it is there,
+ * otherwise its compiles and link are issued without checking on any of them.
+ * 
+ * @param shader_paths  Path to each shader on disk
+ * @param types         The type of each shader
+ * @param shader_count  The number of shaders (1 or 2)
+ * @param defines       Lines of #defines inserted after the #version line of each shader (NULL for none)
+ * @return pending_program_t  The program, to be finished by finishProgram
+ */
+static pending_program_t beginProgram(const char *const *shader_paths, const GLenum *types, size_t shader_count,
+  const char *defines) {
+  assert(shader_paths && types && shader_count >= 1 && shader_count <= 2);
+
+  pending_program_t pending;
+  memset(&pending, 0, sizeof(pending_program_t));
+
+  // Load the shaders from disk
+  char *sources[2] = {NULL, NULL};
+  for (size_t s = 0; s < shader_count; s++)
+    sources[s] = readShaderSource(shader_paths[s]);
+
+  // Use the program linked on an earlier run if the cache has it for these sources and this driver
+  pending.cached = programCacheAvailable();
+  if (pending.cached) {
+    pending.key = hashProgramSources((const char *const *)sources, shader_count, defines);
+    pending.program = loadCachedProgram(pending.key);
+  }
+
+  if (pending.program)
+    pending.cached = false;   // Already is
+  else {
+    // Issue the compiles and the link one after the other, the driver can queue them all
+    pending.program = glCreateProgram();
+    if (pending.cached)
+      glProgramParameteri(pending.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);  // So it can be cached
+    for (size_t s = 0; s < shader_count; s++) {
+      pending.shaders[s] = issueShader(sources[s], types[s], defines);
+      glAttachShader(pending.program, pending.shaders[s]);
+    }
+    glLinkProgram(pending.program);
+  }
+
+  for (size_t s = 0; s < shader_count; s++)
+    free(sources[s]);
+
+  return pending;
+}
+
+/**
+ * @brief Local helper function for checking whether a program can be finished without waiting on the driver.
+ * Without GL_KHR_parallel_shader_compile there is no asking, so a program only counts as done once it is finished.
+ * 
+ * @param pending   The program
+ * @return true   If it is done compiling and linking
+ * @return false  If the driver is still working on it (or there is no asking)
+ */
+static bool programReady(const pending_program_t *pending) {
+  if (!parallelCompileAvailable())
+    return false;
+
+  GLint done = GL_TRUE;
+  glGetProgramiv(pending->program, GL_COMPLETION_STATUS_KHR, &done);
+  return done == GL_TRUE;
+}
+
+/**
+ * @brief Local helper function for finishing a program started by beginProgram, waiting on the driver if it isn't
+ * done yet. This is where compile and link errors are caught.
+ * 
+ * @param pending   The program (cleared once it is finished)
+ * @return GLuint   The linked program
+ */
+static GLuint finishProgram(pending_program_t *pending) {
+  assert(pending && pending->program);
+
+  GLuint program = pending->program;  // The shader program to return
+  GLint success;  // Success flag
+  GLchar error_log[LOG_SIZE];  // Allocate LOG_SIZE bytes for error logging
+
+  // Check for linker error, blaming the shader that didn't compile if there is one
+  glGetProgramiv(program, GL_LINK_STATUS, &success);
+  if (!success) {
+    for (size_t s = 0; s < 2 && pending->shaders[s]; s++) {
+      glGetShaderiv(pending->shaders[s], GL_COMPILE_STATUS, &success);
+      if (!success) {
+        glGetShaderInfoLog(pending->shaders[s], LOG_SIZE, NULL, error_log);
+
+        fprintf(stderr, "Shader program failed to compile. Error: %s\n", error_log);
+        exit(EXIT_FAILURE);   // Terminate program
+      }
+    }
+    glGetProgramInfoLog(program, LOG_SIZE, NULL, error_log);   // Get the error
+
+    fprintf(stderr, "Failed to link shaders! Error: %s\n", error_log);
+    exit(EXIT_FAILURE);   // Terminate program
+  }
+
+  // Detach and delete the shaders since we have our program now
+  for (size_t s = 0; s < 2 && pending->shaders[s]; s++) {
+    glDetachShader(program, pending->shaders[s]);
+    glDeleteShader(pending->shaders[s]);
+  }
+
+  if (pending->cached)
+    saveCachedProgram(pending->key, program);
+  cacheUniformLocations(program);
+
+  memset(pending, 0, sizeof(pending_program_t));
+  return program;  // Return the compiled and linked program
+}
+
+/**
+ * @brief Local helper function for starting a variant of a shader with one #define per feature
+ * 
+ * @param variants 
+ * @param features  A bitmask of features
+ */
+static void beginShaderVariant(shader_variants_t *variants, GLuint features) {
+  char defines[SHADER_DEFINES_SIZE] = "";
+  size_t length = 0;
+  for (GLuint feature = 0; feature < variants->feature_count; feature++) {
+    if (features & (1u << feature)) {
+      int written = snprintf(defines + length, sizeof(defines) - length, "#define %s\n", variants->feature_names[feature]);
+      assert(written > 0 && length + (size_t)written < sizeof(defines));
+      length += (size_t)written;
+    }
+  }
+
+  const char *shader_paths[] = {variants->vertex_shader_path, variants->fragment_shader_path};
+  const GLenum types[] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+  variants->pending[features] = beginProgram(shader_paths, types, 2, defines);
+}
+
+/**
+ * @brief Local helper function for finishing a started variant of a shader and setting it up
+ * 
+ * @param variants 
+ * @param features  A bitmask of features
+ */
+static void finishShaderVariant(shader_variants_t *variants, GLuint features) {
+  GLuint program = finishProgram(&variants->pending[features]);
+  if (variants->setup)
+    variants->setup(program);
+  variants->programs[features] = program;
+}
+
+/**
+ * @brief Local helper function for deciding whether a uniform update has to reach OpenGL. Values of up to
+ * UNIFORM_VALUE_SIZE bytes are remembered so setting a uniform to what it already holds is skipped.
+ * 
+ * @param program 
+ * @param name 
+ * @param value     The new value
+ * @param size      The size of the new value in bytes
+ * @param location  Where to store the location of the uniform
+ * @return bool     Whether the update needs to be issued
+ */
+static bool uniformChanged(GLuint program, const char *name, const void *value, GLsizei size, GLint *location) {
+  cached_uniform_t *uniform = findUniform(program, name);
+  if (!uniform) {
+    gl_state_counters.uniforms_elided++;  // Inactive uniforms have location -1, OpenGL would ignore the update
+    return false;
+  }
+
+  *location = uniform->location;
+  if (size <= UNIFORM_VALUE_SIZE) {
+    if (uniform->value_size == size && memcmp(uniform->value, value, size) == 0) {
+      gl_state_counters.uniforms_elided++;
+      return false;
+    }
+    memcpy(uniform->value, value, size);
+    uniform->value_size = size;
+  }
+
+  gl_state_counters.uniforms++;
+  return true;
+}
+
+/**
+ * @brief Local helper function for updating a cached binding
+ * 
+ * @param cached    What the state cache holds for the binding
+ * @param object    The object to bind
+ * @return bool     Whether the bind needs to be issued
+ */
+static bool bindingChanged(GLuint *cached, GLuint object) {
+  if (*cached == object) {
+    gl_state_counters.binds_elided++;
+    return false;
+  }
+  *cached = object;
+  gl_state_counters.binds++;
+  return true;
+}
+
+/**
+ * @brief Local helper function for finding where the state cache keeps a buffer target
+ * 
+ * @param target 
+ * @return GLuint*  The cached binding, or NULL if the target isn't cached
+ */
+static GLuint *cachedBufferBinding(GLenum target) {
+  switch (target) {
+    case GL_ARRAY_BUFFER:           return &gl_state.array_buffer;
+    case GL_COPY_WRITE_BUFFER:      return &gl_state.copy_write_buffer;
+    case GL_DRAW_INDIRECT_BUFFER:   return &gl_state.draw_indirect_buffer;
+    case GL_ELEMENT_ARRAY_BUFFER:   return gl_state.vertex_array ? &gl_state.vertex_array->element_array_buffer : NULL;
+    case GL_SHADER_STORAGE_BUFFER:  return &gl_state.shader_storage_buffer;
+    case GL_UNIFORM_BUFFER:         return &gl_state.uniform_buffer;
+    default:                        return NULL;
+  }
+}
+
+/**
+ * @brief Local helper function for unbinding a buffer in the state cache before it is deleted (OpenGL resets the
+ * bindings of a deleted buffer to 0)
+ * 
+ * @param buffer 
+ */
+static void forgetBuffer(GLuint buffer) {
+  GLuint *bindings[] = {
+    &gl_state.array_buffer, &gl_state.copy_write_buffer,
+    &gl_state.draw_indirect_buffer, &gl_state.shader_storage_buffer, &gl_state.uniform_buffer
+  };
+  for (size_t i = 0; i < sizeof(bindings) / sizeof(bindings[0]); i++)
+    if (*bindings[i] == buffer)
+      *bindings[i] = 0;
+  for (GLuint index = 0; index < MAX_UNIFORM_BUFFER_BINDINGS; index++)
+    if (gl_state.uniform_ranges[index].buffer == buffer)
+      gl_state.uniform_ranges[index] = (buffer_range_t){0, 0, 0};
+
+  // Only the bound vertex array lets go of a deleted buffer, the rest keep pointing at the dead name
+  for (GLuint slot = 0; slot < MAX_CACHED_VERTEX_ARRAYS; slot++) {
+    vertex_array_state_t *vertex_array = &gl_state.vertex_arrays[slot];
+    if (vertex_array->element_array_buffer == buffer)
+      vertex_array->element_array_buffer = UNKNOWN_BINDING;
+    if (vertex_array->vertex_buffer == buffer)
+      vertex_array->vertex_buffer = UNKNOWN_BINDING;
+  }
+}
+
+/**
+ * @brief Local helper function for finding the state kept for a vertex array, giving it a free slot the first time
+ * it is bound. Nothing is known about what it had bound before then.
+ * 
+ * @param vao 
+ * @return vertex_array_state_t*    The state kept for it, or NULL if every slot is taken
+ */
+static vertex_array_state_t *findVertexArrayState(GLuint vao) {
+  if (vao == 0 || vao == UNKNOWN_BINDING)
+    return NULL;
+
+  for (GLuint slot = 0; slot < MAX_CACHED_VERTEX_ARRAYS; slot++) {
+    vertex_array_state_t *vertex_array = &gl_state.vertex_arrays[slot];
+    if (vertex_array->vao == vao)
+      return vertex_array;
+    if (vertex_array->vao == 0) {
+      *vertex_array = (vertex_array_state_t){vao, UNKNOWN_BINDING, UNKNOWN_BINDING, UNKNOWN_BINDING};
+      return vertex_array;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Local helper function for unbinding a texture in the state cache before it is deleted
+ * 
+ * @param texture 
+ */
+static void forgetTexture(GLuint texture) {
+  for (GLuint unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+    if (gl_state.textures[unit] == texture)
+      gl_state.textures[unit] = 0;
+}
+
+
+// MESH FUNCTIONS //
+
+/**
+ * @brief Local helper that converts a float to a half float, rounding to nearest. Values too small for a normal
+ * half are flushed to zero, which is below the precision needed for texture coordinates anyway.
+ * 
+ * @param value     The float to convert
+ * @return GLhalf   The half float
+ */
+static GLhalf floatToHalf(float value) {
+  union { float f; uint32_t u; } bits = { value };
+
+  uint32_t sign = (bits.u >> 16) & 0x8000;                        // Sign bit moved to the top of 16 bits
+  int32_t exponent = (int32_t)((bits.u >> 23) & 0xff) - 127 + 15;  // Rebias the exponent for halves
+  uint32_t mantissa = bits.u & 0x7fffff;
+
+  if (exponent <= 0)
+    return (GLhalf)sign;            // Too small, flush to zero
+  if (exponent >= 31)
+    return (GLhalf)(sign | 0x7c00); // Too big, clamp to infinity
+
+  // Keep the top 10 mantissa bits and round with the next one (a carry correctly bumps the exponent)
+  uint32_t half = sign | ((uint32_t)exponent << 10) | (mantissa >> 13);
+  half += (mantissa >> 12) & 1;
+
+  return (GLhalf)half;
+}
+
+/**
+ * @brief Local helper that converts a float in [-1, 1] to snorm16
+ * 
+ * @param value     The float to convert
+ * @return GLshort  The snorm16 value
+ */
+static GLshort floatToSnorm16(float value) {
+  value = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+  return (GLshort)lroundf(value * 32767.0f);
+}
+
+/**
+ * @brief Local helper that encodes a normal vector with the octahedral mapping. The normal is projected onto the
+ * octahedron |x| + |y| + |z| = 1 and the lower half is folded over the diagonals, leaving a point in [-1, 1]^2.
+ * vertex.glsl has the matching decodeOctahedral.
+ * 
+ * @param normal  The normal vector to encode
+ * @param dest    The encoded pair
+ */
+static void encodeOctahedral(const vec3 normal, GLshort dest[2]) {
+  float l1 = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+  float x = l1 > 0.0f ? normal[0] / l1 : 0.0f;
+  float y = l1 > 0.0f ? normal[1] / l1 : 0.0f;
+
+  // Fold the lower hemisphere over the diagonals
+  if (normal[2] < 0.0f) {
+    float folded_x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+    float folded_y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    x = folded_x;
+    y = folded_y;
+  }
+
+  dest[0] = floatToSnorm16(x);
+  dest[1] = floatToSnorm16(y);
+}
+
+/**
+ * @brief Local helper that packs vertices into packed_vertex_t
+ * 
+ * @param vertices  The vertices to pack
+ * @param count     The number of vertices
+ * @param dest      Where to write the packed vertices
+ * @return GLfloat  The position scale the packed positions are in units of
+ */
+static GLfloat packVertices(const vertex_t *vertices, GLsizei count, packed_vertex_t *dest) {
+  // The positions are stored relative to the largest coordinate so they use the whole snorm16 range
+  GLfloat position_scale = 0.0f;
+  for (GLsizei i = 0; i < count; i++)
+    for (int j = 0; j < 3; j++)
+      position_scale = fmaxf(position_scale, fabsf(vertices[i].position[j]));
+  if (position_scale == 0.0f)
+    position_scale = 1.0f;
+
+  for (GLsizei i = 0; i < count; i++) {
+    for (int j = 0; j < 3; j++)
+      dest[i].position[j] = floatToSnorm16(vertices[i].position[j] / position_scale);
+    dest[i].position[3] = 0;
+    encodeOctahedral(vertices[i].normal, dest[i].normal);
+    dest[i].uv[0] = floatToHalf(vertices[i].uv[0]);
+    dest[i].uv[1] = floatToHalf(vertices[i].uv[1]);
+  }
+
+  return position_scale;
+}
+
+/**
+ * @brief Local helper that scores a vertex for the Forsyth vertex cache optimization. Vertices that are in the cache
+ * score higher the more recently they were used, and vertices with few triangles left get a boost so they are
+ * finished off instead of being left to be transformed again later.
+ * 
+ * @param cache_position  The position of the vertex in the cache (-1 if not in it)
+ * @param remaining       The number of triangles using the vertex that haven't been added yet
+ * @return float          The score of the vertex
+ */
+static float forsythVertexScore(GLint cache_position, GLuint remaining) {
+  if (remaining == 0)
+    return -1.0f;   // No triangles left to use it
+
+  float score = 0.0f;
+  if (cache_position >= 0) {
+    if (cache_position < 3)
+      score = FORSYTH_LAST_TRIANGLE_SCORE;  // Used by the last triangle, which could be in either order
+    else {
+      float scaler = 1.0f - (float)(cache_position - 3) / (float)(FORSYTH_CACHE_SIZE - 3);
+      score = powf(scaler, FORSYTH_CACHE_DECAY_POWER);
+    }
+  }
+
+  return score + FORSYTH_VALENCE_BOOST_SCALE * powf((float)remaining, -FORSYTH_VALENCE_BOOST_POWER);
+}
+
+/**
+ * @brief Local helper that optimizes a mesh and bakes it into a mesh blob. The mesh's vertex_count, element_count,
+ * and draw_mode must already be set. The vertices are packed in DEFAULT_VERTEX_FORMAT and the elements are stored
+ * as 16 bit indices whenever the mesh is small enough.
+ * 
+ * @param mesh            The mesh to bake
+ * @param vertices        The vertex data (mesh->vertex_count entries, reordered in place)
+ * @param elements        The element data (mesh->element_count entries, reordered in place)
+ * @return mesh_blob_t*   The baked mesh
+ */
+static mesh_blob_t *packMesh(const mesh_t *mesh, vertex_t *vertices, GLuint *elements) {
+  // Reorder the triangles and vertices to make the best use of the vertex caches
+  if (mesh->draw_mode == GL_TRIANGLES)
+    optimizeMesh(vertices, mesh->vertex_count, elements, mesh->element_count);
+
+  // Fill in the header
+  mesh_blob_t header;
+  memcpy(header.magic, "RTSM", 4);
+  header.version = MESH_CACHE_VERSION;
+  header.draw_mode = mesh->draw_mode;
+  header.index_type = mesh->vertex_count <= MAX_SHORT_INDEX_VERTICES ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+  header.vertex_format = DEFAULT_VERTEX_FORMAT;
+  header.vertex_count = mesh->vertex_count;
+  header.element_count = mesh->element_count;
+  header.position_scale = 1.0f;
+  header.vertex_bytes = mesh->vertex_count *
+    (header.vertex_format == VERTEX_FORMAT_PACKED ? sizeof(packed_vertex_t) : sizeof(vertex_t));
+  header.element_bytes = mesh->element_count *
+    (header.index_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint));
+
+  mesh_blob_t *blob = (mesh_blob_t *)malloc(sizeof(mesh_blob_t) + header.vertex_bytes + header.element_bytes);
+  assert(blob);
+  unsigned char *vertex_data = (unsigned char *)(blob + 1);
+  unsigned char *element_data = vertex_data + header.vertex_bytes;
+
+  // Vertices
+  if (header.vertex_format == VERTEX_FORMAT_PACKED)
+    header.position_scale = packVertices(vertices, mesh->vertex_count, (packed_vertex_t *)vertex_data);
+  else
+    memcpy(vertex_data, vertices, header.vertex_bytes);
+
+  // Elements
+  if (header.index_type == GL_UNSIGNED_SHORT) {
+    GLushort *short_elements = (GLushort *)element_data;
+    for (GLsizei i = 0; i < mesh->element_count; i++)
+      short_elements[i] = (GLushort)elements[i];
+  }
+  else
+    memcpy(element_data, elements, header.element_bytes);
+
+  *blob = header;
+
+  return blob;
+}
+
+/**
+ * @brief A midpoint_cache_t is an open addressing hash table that maps an edge (a pair of vertex indices) to the
+ * index of the vertex at its midpoint, so that the two triangles sharing an edge also share the new vertex
+ * 
+ */
+typedef struct {
+  uint64_t *keys;     // The edge of each slot, packed as (min << 32 | max), or EMPTY_EDGE
+  GLuint *values;     // The midpoint vertex of each slot
+  size_t mask;        // The number of slots - 1 (the number of slots is a power of 2)
+} midpoint_cache_t;
+
+#define EMPTY_EDGE UINT64_MAX
+
+/**
+ * @brief Local helper that finds the midpoint of an edge on the sphere, creating it if it doesn't exist yet
+ * 
+ * @param cache       The midpoint cache for the current subdivision level
+ * @param positions   The vertex positions (new midpoints are appended)
+ * @param count       The number of positions (incremented when a midpoint is added)
+ * @param radius      The radius of the sphere
+ * @param a           The first vertex of the edge
+ * @param b           The second vertex of the edge
+ * @return GLuint     The index of the midpoint vertex
+ */
+static GLuint getMidpoint(midpoint_cache_t *cache, vec3 *positions, GLuint *count, float radius, GLuint a, GLuint b) {
+  // Both triangles on an edge see it in opposite directions so order the key
+  uint64_t key = a < b ? ((uint64_t)a << 32 | b) : ((uint64_t)b << 32 | a);
+  size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & cache->mask;  // Fibonacci hashing
+
+  // Linear probing
+  while (cache->keys[slot] != EMPTY_EDGE) {
+    if (cache->keys[slot] == key)
+      return cache->values[slot];
+    slot = (slot + 1) & cache->mask;
+  }
+
+  // Not found, so push the midpoint out onto the sphere and remember it
+  GLuint midpoint = (*count)++;
+  glm_vec3_add(positions[a], positions[b], positions[midpoint]);
+  glm_vec3_scale_as(positions[midpoint], radius, positions[midpoint]);
+
+  cache->keys[slot] = key;
+  cache->values[slot] = midpoint;
+
+  return midpoint;
+}
+
+/**
+ * @brief Local helper that computes the longitude texture coordinate (u) of a point on the sphere, matching
+ * buildSphereMesh
+ * 
+ */
+static float sphereU(const vec3 position) {
+  float u = atan2f(position[1], position[0]) / (2.0f * GLM_PIf);
+  return u < 0.0f ? u + 1.0f : u;
+}
+
+// MATRIX FUNCTIONS //
+
+/**
+ * @brief Local helper that builds the model matrices for objects [begin, end) one at a time
+ * 
+ */
+static void buildModelMatricesScalar(
+  const vec3 *positions, const versor *orientations, const vec3 *scales, const vec3 *pivots, mat4 *model_matrices,
+  size_t begin, size_t end) {
+  for (size_t i = begin; i < end; i++) {
+    const float *q = orientations[i];
+    const float *s = scales[i];
+    float *m0 = model_matrices[i][0], *m1 = model_matrices[i][1], *m2 = model_matrices[i][2], *m3 = model_matrices[i][3];
+
+    float xx = q[0] * q[0], yy = q[1] * q[1], zz = q[2] * q[2];
+    float xy = q[0] * q[1], xz = q[0] * q[2], yz = q[1] * q[2];
+    float wx = q[3] * q[0], wy = q[3] * q[1], wz = q[3] * q[2];
+
+    // The columns of the rotation matrix, each scaled by its scale component
+    m0[0] = s[0] * (1.0f - 2.0f * (yy + zz)); m0[1] = s[0] * 2.0f * (xy + wz); m0[2] = s[0] * 2.0f * (xz - wy); m0[3] = 0.0f;
+    m1[0] = s[1] * 2.0f * (xy - wz); m1[1] = s[1] * (1.0f - 2.0f * (xx + zz)); m1[2] = s[1] * 2.0f * (yz + wx); m1[3] = 0.0f;
+    m2[0] = s[2] * 2.0f * (xz + wy); m2[1] = s[2] * 2.0f * (yz - wx); m2[2] = s[2] * (1.0f - 2.0f * (xx + yy)); m2[3] = 0.0f;
+
+    // Translation is position + pivot - (R * S) * pivot
+    m3[0] = positions[i][0];
+    m3[1] = positions[i][1];
+    m3[2] = positions[i][2];
+    m3[3] = 1.0f;
+    if (pivots) {
+      const float *c = pivots[i];
+      m3[0] += c[0] - (m0[0] * c[0] + m1[0] * c[1] + m2[0] * c[2]);
+      m3[1] += c[1] - (m0[1] * c[0] + m1[1] * c[1] + m2[1] * c[2]);
+      m3[2] += c[2] - (m0[2] * c[0] + m1[2] * c[1] + m2[2] * c[2]);
+    }
+  }
+}
+
+#ifdef CGLM_SSE_FP
+
+/**
+ * @brief Local helper that splits four consecutive vec3s (12 floats) into their x, y and z components
+ * 
+ */
+static inline void loadVec3x4(const float *src, __m128 *x, __m128 *y, __m128 *z) {
+  __m128 a = _mm_loadu_ps(src + 0);   // x0 y0 z0 x1
+  __m128 b = _mm_loadu_ps(src + 4);   // y1 z1 x2 y2
+  __m128 c = _mm_loadu_ps(src + 8);   // z2 x3 y3 z3
+
+  *x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+  *y = _mm_shuffle_ps(
+    _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+  *z = _mm_shuffle_ps(
+    _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+/**
+ * @brief Local helper that transposes one column of four matrices from component vectors and stores it
+ * 
+ */
+static inline void storeColumnx4(__m128 r0, __m128 r1, __m128 r2, __m128 r3, mat4 *model_matrices, int column) {
+  _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+  _mm_storeu_ps(model_matrices[0][column], r0);
+  _mm_storeu_ps(model_matrices[1][column], r1);
+  _mm_storeu_ps(model_matrices[2][column], r2);
+  _mm_storeu_ps(model_matrices[3][column], r3);
+}
+
+/**
+ * @brief Local helper that builds the model matrices for four objects at once. Every register holds one component
+ * for all four objects, so the math is the same as buildModelMatricesScalar.
+ * 
+ */
+static void buildModelMatricesx4(
+  const vec3 *positions, const versor *orientations, const vec3 *scales, const vec3 *pivots, mat4 *model_matrices) {
+  const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), zero = _mm_setzero_ps();
+
+  // Gather the quaternions as x, y, z, w component vectors
+  __m128 qx = _mm_loadu_ps(orientations[0]);
+  __m128 qy = _mm_loadu_ps(orientations[1]);
+  __m128 qz = _mm_loadu_ps(orientations[2]);
+  __m128 qw = _mm_loadu_ps(orientations[3]);
+  _MM_TRANSPOSE4_PS(qx, qy, qz, qw);
+
+  __m128 sx, sy, sz;  loadVec3x4(scales[0], &sx, &sy, &sz);
+  __m128 px, py, pz;  loadVec3x4(positions[0], &px, &py, &pz);
+
+  __m128 xx = _mm_mul_ps(qx, qx), yy = _mm_mul_ps(qy, qy), zz = _mm_mul_ps(qz, qz);
+  __m128 xy = _mm_mul_ps(qx, qy), xz = _mm_mul_ps(qx, qz), yz = _mm_mul_ps(qy, qz);
+  __m128 wx = _mm_mul_ps(qw, qx), wy = _mm_mul_ps(qw, qy), wz = _mm_mul_ps(qw, qz);
+
+  // Scaled rotation columns
+  __m128 m00 = _mm_mul_ps(sx, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))));
+  __m128 m01 = _mm_mul_ps(sx, _mm_mul_ps(two, _mm_add_ps(xy, wz)));
+  __m128 m02 = _mm_mul_ps(sx, _mm_mul_ps(two, _mm_sub_ps(xz, wy)));
+  __m128 m10 = _mm_mul_ps(sy, _mm_mul_ps(two, _mm_sub_ps(xy, wz)));
+  __m128 m11 = _mm_mul_ps(sy, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))));
+  __m128 m12 = _mm_mul_ps(sy, _mm_mul_ps(two, _mm_add_ps(yz, wx)));
+  __m128 m20 = _mm_mul_ps(sz, _mm_mul_ps(two, _mm_add_ps(xz, wy)));
+  __m128 m21 = _mm_mul_ps(sz, _mm_mul_ps(two, _mm_sub_ps(yz, wx)));
+  __m128 m22 = _mm_mul_ps(sz, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))));
+
+  // Translation is position + pivot - (R * S) * pivot
+  if (pivots) {
+    __m128 cx, cy, cz;  loadVec3x4(pivots[0], &cx, &cy, &cz);
+    px = _mm_add_ps(px, _mm_sub_ps(cx, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, cx), _mm_mul_ps(m10, cy)), _mm_mul_ps(m20, cz))));
+    py = _mm_add_ps(py, _mm_sub_ps(cy, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m01, cx), _mm_mul_ps(m11, cy)), _mm_mul_ps(m21, cz))));
+    pz = _mm_add_ps(pz, _mm_sub_ps(cz, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m02, cx), _mm_mul_ps(m12, cy)), _mm_mul_ps(m22, cz))));
+  }
+
+  storeColumnx4(m00, m01, m02, zero, model_matrices, 0);
+  storeColumnx4(m10, m11, m12, zero, model_matrices, 1);
+  storeColumnx4(m20, m21, m22, zero, model_matrices, 2);
+  storeColumnx4(px, py, pz, one, model_matrices, 3);
+}
+
+#endif
+
+
+// INTERPOLATION FUNCTIONS //
+
+/**
+ * @brief Local helper that interpolates orientations [begin, end) one at a time
+ * 
+ */
+static void interpolateOrientationsScalar(const interpol_quat_t *states, float alpha, versor *dest, size_t begin, size_t end) {
+  for (size_t i = begin; i < end; i++) {
+    const float *c = states[i].curr, *p = states[i].prev;
+
+    // Flip the current orientation onto the same hemisphere as the previous one to take the shortest arc
+    float t = (c[0] * p[0] + c[1] * p[1] + c[2] * p[2] + c[3] * p[3]) < 0.0f ? -alpha : alpha;
+    float u = 1.0f - alpha;
+    versor q = {p[0] * u + c[0] * t, p[1] * u + c[1] * t, p[2] * u + c[2] * t, p[3] * u + c[3] * t};
+
+    glm_quat_normalize_to(q, dest[i]);
+  }
+}
+
+#ifdef CGLM_SSE_FP
+
+/**
+ * @brief Local helper that interpolates four orientations at once
+ * 
+ */
+static void interpolateOrientationsx4(const interpol_quat_t *states, float alpha, versor *dest) {
+  const __m128 a = _mm_set1_ps(alpha), u = _mm_set1_ps(1.0f - alpha), sign = _mm_set1_ps(-0.0f);
+
+  // Gather the current and previous quaternions as x, y, z, w component vectors
+  __m128 cx = _mm_loadu_ps(states[0].curr), cy = _mm_loadu_ps(states[1].curr);
+  __m128 cz = _mm_loadu_ps(states[2].curr), cw = _mm_loadu_ps(states[3].curr);
+  __m128 px = _mm_loadu_ps(states[0].prev), py = _mm_loadu_ps(states[1].prev);
+  __m128 pz = _mm_loadu_ps(states[2].prev), pw = _mm_loadu_ps(states[3].prev);
+  _MM_TRANSPOSE4_PS(cx, cy, cz, cw);
+  _MM_TRANSPOSE4_PS(px, py, pz, pw);
+
+  // Take the sign of the dot product over to alpha so we go the short way around
+  __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, px), _mm_mul_ps(cy, py)), _mm_add_ps(_mm_mul_ps(cz, pz), _mm_mul_ps(cw, pw)));
+  __m128 t = _mm_xor_ps(a, _mm_and_ps(d, sign));
+
+  __m128 qx = _mm_add_ps(_mm_mul_ps(px, u), _mm_mul_ps(cx, t));
+  __m128 qy = _mm_add_ps(_mm_mul_ps(py, u), _mm_mul_ps(cy, t));
+  __m128 qz = _mm_add_ps(_mm_mul_ps(pz, u), _mm_mul_ps(cz, t));
+  __m128 qw = _mm_add_ps(_mm_mul_ps(pw, u), _mm_mul_ps(cw, t));
+
+  // Normalize
+  __m128 n = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, qx), _mm_mul_ps(qy, qy)), _mm_add_ps(_mm_mul_ps(qz, qz), _mm_mul_ps(qw, qw))));
+  __m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), n);
+  qx = _mm_mul_ps(qx, inv);
+  qy = _mm_mul_ps(qy, inv);
+  qz = _mm_mul_ps(qz, inv);
+  qw = _mm_mul_ps(qw, inv);
+
+  _MM_TRANSPOSE4_PS(qx, qy, qz, qw);
+  _mm_storeu_ps(dest[0], qx);
+  _mm_storeu_ps(dest[1], qy);
+  _mm_storeu_ps(dest[2], qz);
+  _mm_storeu_ps(dest[3], qw);
+}
+
+#endif
+
+
+// GLOBAL FUNCTIONS //
+
+// SHADER FUNCTIONS //
+
+GLuint compileAndLinkShaderProgram(const char *vertex_shader_path, const char *fragment_shader_path) {
+  return compileAndLinkShaderVariant(vertex_shader_path, fragment_shader_path, NULL);
+}
+
+GLuint compileAndLinkShaderVariant(const char *vertex_shader_path, const char *fragment_shader_path,
+  const char *defines) {
+  // Assertions
+  assert(vertex_shader_path && fragment_shader_path);   // All programs need vertex and fragment shaders
+
+  // Compile and link the vertex and fragment shaders, then wait for them
+  const char *shader_paths[] = {vertex_shader_path, fragment_shader_path};
+  const GLenum types[] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+  pending_program_t pending = beginProgram(shader_paths, types, 2, defines);
+  return finishProgram(&pending);
+}
+
+GLuint compileAndLinkComputeProgram(const char *compute_shader_path) {
+  // Assertions
+  assert(compute_shader_path);
+
+  // Compile the compute shader and link it on its own
+  const GLenum type = GL_COMPUTE_SHADER;
+  pending_program_t pending = beginProgram(&compute_shader_path, &type, 1, NULL);
+  return finishProgram(&pending);
+}
+
+void setUniformVec4(GLuint program, const char *uniform_name, vec4 vector) {
+  GLint location;
+  if (uniformChanged(program, uniform_name, vector, sizeof(vec4), &location))
+    glUniform4fv(location, 1, vector);
+}
+
+void setUniformVec3(GLuint program, const char *uniform_name, vec3 vector) {
+  GLint location;
+  if (uniformChanged(program, uniform_name, vector, sizeof(vec3), &location))
+    glUniform3fv(location, 1, vector);
+}
+
+void setUniformMat3(GLuint program, const char *uniform_name, mat3 matrix) {
+  GLint location;
+  if (uniformChanged(program, uniform_name, matrix, sizeof(mat3), &location))
+    glUniformMatrix3fv(location, 1, GL_FALSE, (const GLfloat *)matrix);
+}
+
+void setUniformMat4(GLuint program, const char *uniform_name, mat4 matrix) {
+  GLint location;
+  if (uniformChanged(program, uniform_name, matrix, sizeof(mat4), &location))
+    glUniformMatrix4fv(location, 1, GL_FALSE, (GLfloat *)matrix);
+}
+
+void setUniformFloat(GLuint program, const char *uniform_name, float v) {
+  GLint location;
+  if (uniformChanged(program, uniform_name, &v, sizeof(float), &location))
+    glUniform1f(location, v);
+}
+
+void setUniformFloatArray(GLuint program, const char *uniform_name, const float *v, GLsizei count) {
+  GLint location;
+  if (uniformChanged(program, uniform_name, v, count * (GLsizei)sizeof(float), &location))
+    glUniform1fv(location, count, v);
+}
+
+void setUniformVec4Array(GLuint program, const char *uniform_name, const vec4 *vectors, GLsizei count) {
+  GLint location;
+  if (uniformChanged(program, uniform_name, vectors, count * (GLsizei)sizeof(vec4), &location))
+    glUniform4fv(location, count, (const GLfloat *)vectors);
+}
+
+void setUniformInt(GLuint program, const char *uniform_name, int v) {
+  GLint location;
+  if (uniformChanged(program, uniform_name, &v, sizeof(int), &location))
+    glUniform1i(location, v);
+}
+
+void setUniformUint(GLuint program, const char *uniform_name, GLuint v) {
+  GLint location;
+  if (uniformChanged(program, uniform_name, &v, sizeof(GLuint), &location))
+    glUniform1ui(location, v);
+}
+
+void setUniformBlockBinding(GLuint program, const char *block_name, GLuint binding) {
+  GLuint index = glGetUniformBlockIndex(program, block_name);
+  if (index != GL_INVALID_INDEX)  // Blocks the program doesn't use are left alone
+    glUniformBlockBinding(program, index, binding);
+}
+
+shader_variants_t buildShaderVariants(const char *vertex_shader_path, const char *fragment_shader_path,
+  const char *const *feature_names, GLuint feature_count, GLuint required_features, void (*setup)(GLuint program)) {
+  assert(vertex_shader_path && fragment_shader_path && feature_count <= MAX_SHADER_FEATURES);
+  assert(feature_names || feature_count == 0);
+
+  shader_variants_t variants;
+  memset(&variants, 0, sizeof(shader_variants_t));
+  variants.vertex_shader_path = vertex_shader_path;
+  variants.fragment_shader_path = fragment_shader_path;
+  variants.feature_names = feature_names;
+  variants.feature_count = feature_count;
+  variants.required_features = required_features & ((1u << feature_count) - 1);
+  variants.setup = setup;
+  return variants;
+}
+
+GLuint getShaderVariant(shader_variants_t *variants, GLuint features) {
+  assert(variants && features < (1u << variants->feature_count));
+  if (variants->programs[features])
+    return variants->programs[features];
+
+  // Draw with the fallback while the variant is still compiling in the background
+  GLuint fallback = features & variants->required_features;
+  pending_program_t *pending = &variants->pending[features];
+  if (pending->program && fallback != features && !programReady(pending))
+    return getShaderVariant(variants, fallback);
+
+  // Otherwise finish it now, starting it first if nothing asked for it up front
+  if (!pending->program)
+    beginShaderVariant(variants, features);
+  finishShaderVariant(variants, features);
+  return variants->programs[features];
+}
+
+void compileShaderVariants(shader_variants_t *variants) {
+  assert(variants);
+
+  // Fallbacks first so the driver gets to them first
+  GLuint variant_count = 1u << variants->feature_count;
+  for (GLuint features = 0; features < variant_count; features++)
+    if ((features & ~variants->required_features) == 0 && !variants->programs[features] &&
+      !variants->pending[features].program)
+      beginShaderVariant(variants, features);
+  for (GLuint features = 0; features < variant_count; features++)
+    if (!variants->programs[features] && !variants->pending[features].program)
+      beginShaderVariant(variants, features);
+}
+
+void updateShaderVariants(shader_variants_t *variants) {
+  assert(variants);
+
+  GLuint variant_count = 1u << variants->feature_count;
+  if (parallelCompileAvailable()) {
+    for (GLuint features = 0; features < variant_count; features++)
+      if (variants->pending[features].program && programReady(&variants->pending[features]))
+        finishShaderVariant(variants, features);
+    return;
+  }
+
+  // Without asking whether any is done, finish one a call (fallbacks first) so waiting on the driver is spread out
+  GLuint next = variant_count;
+  for (GLuint features = 0; features < variant_count; features++) {
+    if (!variants->pending[features].program)
+      continue;
+    if ((features & ~variants->required_features) == 0) {
+      next = features;
+      break;
+    }
+    if (next == variant_count)
+      next = features;
+  }
+  if (next < variant_count)
+    finishShaderVariant(variants, next);
+}
+
+void freeShaderVariants(shader_variants_t *variants) {
+  if (variants) {
+    for (GLuint features = 0; features < (1u << MAX_SHADER_FEATURES); features++) {
+      freeShaderProgram(variants->programs[features]);
+      variants->programs[features] = 0;
+
+      // Variants that never finished were never seen by the state cache
+      pending_program_t *pending = &variants->pending[features];
+      for (size_t s = 0; s < 2; s++)
+        glDeleteShader(pending->shaders[s]);
+      glDeleteProgram(pending->program);
+      memset(pending, 0, sizeof(pending_program_t));
+    }
+  }
+}
 
-  buffer[length] = '\0';  // Add the null terminator
+void freeShaderProgram(GLuint program) {
+  if (program == 0)
+    return;
+
+  // Take the program's uniforms out and put the rest back, so no probe chain runs through a hole
+  static cached_uniform_t kept[MAX_CACHED_UNIFORMS];
+  GLuint kept_count = 0;
+  for (GLuint i = 0; i < MAX_CACHED_UNIFORMS; i++)
+    if (uniform_cache[i].program != 0 && uniform_cache[i].program != program)
+      kept[kept_count++] = uniform_cache[i];
+  memset(uniform_cache, 0, sizeof(uniform_cache));
+  for (GLuint i = 0; i < kept_count; i++) {
+    insertUniform(kept[i].program, kept[i].name, kept[i].location);
+    cached_uniform_t *uniform = findUniform(kept[i].program, kept[i].name);
+    uniform->value_size = kept[i].value_size;
+    memcpy(uniform->value, kept[i].value, sizeof(uniform->value));
+  }
 
-  // SHADER //
+  if (gl_state.program == program)
+    gl_state.program = UNKNOWN_BINDING;   // A deleted program stays current until another is used
+  glDeleteProgram(program);
+}
 
-  // Build requested shader program
-  shader = glCreateShader(type);
-  glShaderSource(shader, 1, &buffer, NULL);
-  glCompileShader(shader);
+// STATE FUNCTIONS //
 
-  free(buffer); // Free the buffer since we no longer need it
+void useProgram(GLuint program) {
+  if (bindingChanged(&gl_state.program, program))
+    glUseProgram(program);
+}
 
-  // Check for errors
-  glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-  if (!success) {
-    glGetShaderInfoLog(shader, LOG_SIZE, NULL, error_log);
+void bindVertexArray(GLuint vao) {
+  if (bindingChanged(&gl_state.vao, vao)) {
+    glBindVertexArray(vao);
+    gl_state.vertex_array = findVertexArrayState(vao);
+  }
+}
 
-    fprintf(stderr, "Shader program failed to compile. Error: %s\n", error_log);
-    exit(EXIT_FAILURE);   // Terminate program
+void bindBuffer(GLenum target, GLuint buffer) {
+  GLuint *cached = cachedBufferBinding(target);
+  if (!cached) {
+    gl_state_counters.binds++;
+    glBindBuffer(target, buffer);
   }
+  else if (bindingChanged(cached, buffer))
+    glBindBuffer(target, buffer);
+}
 
-  return shader;    // Return the shader
+bool vertexAttributesChanged(GLuint buffer, GLuint layout) {
+  vertex_array_state_t *vertex_array = gl_state.vertex_array;
+  if (vertex_array && vertex_array->vertex_buffer == buffer && vertex_array->vertex_layout == layout)
+    return false;
+  if (vertex_array) {
+    vertex_array->vertex_buffer = buffer;
+    vertex_array->vertex_layout = layout;
+  }
+  return true;
 }
 
+void bindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+  // Indexed bindings aren't cached, but the generic binding they also change is
+  GLuint *cached = cachedBufferBinding(target);
+  if (cached)
+    *cached = buffer;
+  if (target == GL_UNIFORM_BUFFER && index < MAX_UNIFORM_BUFFER_BINDINGS)
+    gl_state.uniform_ranges[index].buffer = UNKNOWN_BINDING;  // Binds the whole buffer, whatever its size
+  gl_state_counters.binds++;
+  glBindBufferBase(target, index, buffer);
+}
 
-// GLOBAL FUNCTIONS //
+void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+  GLuint *cached = cachedBufferBinding(target);
+  if (target == GL_UNIFORM_BUFFER && index < MAX_UNIFORM_BUFFER_BINDINGS) {
+    buffer_range_t *range = &gl_state.uniform_ranges[index];
+    if (range->buffer == buffer && range->offset == offset && range->size == size) {
+      gl_state_counters.binds_elided++;
+      return;
+    }
+    *range = (buffer_range_t){buffer, offset, size};
+  }
+  if (cached)
+    *cached = buffer;
+  gl_state_counters.binds++;
+  glBindBufferRange(target, index, buffer, offset, size);
+}
 
-// SHADER FUNCTIONS //
+void bindTexture2D(GLuint unit, GLuint texture) {
+  assert(unit < MAX_TEXTURE_UNITS);
 
-GLuint compileAndLinkShaderProgram(const char *vertex_shader_path, const char *fragment_shader_path) {
-  // Assertions
-  assert(vertex_shader_path && fragment_shader_path);   // All programs need vertex and fragment shaders
+  if (gl_state.textures[unit] == texture) {
+    gl_state_counters.binds_elided++;
+    return;
+  }
+  if (gl_state.active_texture != unit) {
+    glActiveTexture(GL_TEXTURE0 + unit);
+    gl_state.active_texture = unit;
+  }
+  glBindTexture(GL_TEXTURE_2D, texture);
+  gl_state.textures[unit] = texture;
+  gl_state_counters.binds++;
+}
 
-  // OpenGL fields 
-  GLuint program;  // The shader program to return
-  GLuint vertex, fragment;  // The vertex and fragment shaders
-  GLint success;  // Success flag
-  GLchar error_log[LOG_SIZE];  // Allocate LOG_SIZE bytes for error logging
+void invalidateGLStateCache(void) {
+  gl_state.program = UNKNOWN_BINDING;
+  gl_state.vao = UNKNOWN_BINDING;
+  gl_state.vertex_array = NULL;
+  memset(gl_state.vertex_arrays, 0, sizeof(gl_state.vertex_arrays));   // Deleted vertex arrays names get reused
+  gl_state.array_buffer = UNKNOWN_BINDING;
+  gl_state.copy_write_buffer = UNKNOWN_BINDING;
+  gl_state.draw_indirect_buffer = UNKNOWN_BINDING;
+  gl_state.shader_storage_buffer = UNKNOWN_BINDING;
+  gl_state.uniform_buffer = UNKNOWN_BINDING;
+  for (GLuint index = 0; index < MAX_UNIFORM_BUFFER_BINDINGS; index++)
+    gl_state.uniform_ranges[index].buffer = UNKNOWN_BINDING;
+  gl_state.active_texture = UNKNOWN_BINDING;
+  for (GLuint unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+    gl_state.textures[unit] = UNKNOWN_BINDING;
+}
 
-  // Load and compile the vertex and fragment shaders from disk
-  vertex = compileShader(vertex_shader_path, GL_VERTEX_SHADER);   // Compile the vertex shader
-  fragment = compileShader(fragment_shader_path, GL_FRAGMENT_SHADER);   // Compile the fragment shader
+void resetGLStateCounters(void) {
+  memset(&gl_state_counters, 0, sizeof(gl_state_counters_t));
+}
 
-  // Create a program and link the shaders
-  program = glCreateProgram();
-  glAttachShader(program, vertex);    // Attach the vertex shader
-  glAttachShader(program, fragment);  // Attach the fragment shader
+gl_state_counters_t getGLStateCounters(void) {
+  return gl_state_counters;
+}
 
-  glLinkProgram(program); // Link the vertex and fragment shaders
+// STREAM RING FUNCTIONS //
+
+stream_ring_t createStreamRing(GLsizeiptr frame_size, GLint alignment) {
+  assert(frame_size > 0 && alignment > 0 && (alignment & (alignment - 1)) == 0);
+
+  stream_ring_t ring;
+  memset(&ring, 0, sizeof(stream_ring_t));
+
+  // Any range can back a uniform block or a shader storage block, every alignment is a power of 2 so the largest is a
+  // multiple of the others
+  GLint uniform_alignment, storage_alignment = 1;
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_alignment);
+  if (GLAD_GL_ARB_shader_storage_buffer_object)
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storage_alignment);
+  ring.alignment = alignment > uniform_alignment ? alignment : uniform_alignment;
+  ring.alignment = storage_alignment > ring.alignment ? storage_alignment : ring.alignment;
+  ring.frame_size = streamRingStride(&ring, frame_size);  // Every region starts aligned
+  ring.frame = STREAM_RING_FRAMES - 1;    // The first frame begins with region 0
+  ring.head = ring.frame * ring.frame_size;
+
+  GLsizeiptr size = ring.frame_size * STREAM_RING_FRAMES;
+  glGenBuffers(1, &ring.buffer);
+  bindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+  if (USE_PERSISTENT_MAPPING && GLAD_GL_ARB_buffer_storage) {
+    // Map it once and for all, coherent so writes reach the GPU without flushing
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_COPY_WRITE_BUFFER, size, NULL, flags);
+    ring.mapping = (unsigned char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags);
+    if (!ring.mapping) {
+      fprintf(stderr, "Failed to persistently map a stream ring of %ld bytes\n", (long)size);
+      exit(EXIT_FAILURE);
+    }
+  }
+  else
+    glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STREAM_DRAW);
 
-  // Check for linker error
-  glGetProgramiv(program, GL_LINK_STATUS, &success);
-  if (!success) {
-    glGetShaderInfoLog(program, LOG_SIZE, NULL, error_log);   // Get the error
+  return ring;
+}
 
-    fprintf(stderr, "Failed to link shaders! Error: %s\n", error_log);
-    exit(EXIT_FAILURE);   // Terminate program
-  }
+GLsizeiptr streamRingStride(const stream_ring_t *ring, GLsizeiptr size) {
+  assert(ring && ring->alignment > 0);
+  return (size + ring->alignment - 1) / ring->alignment * ring->alignment;
+}
 
-  // Detach the shaders so they can be deleted
-  glDetachShader(program, vertex);
-  glDetachShader(program, fragment);
+void beginStreamRingFrame(stream_ring_t *ring) {
+  assert(ring);
+
+  ring->frame = (ring->frame + 1) % STREAM_RING_FRAMES;
+  ring->head = ring->frame * ring->frame_size;
+
+  // Wait for the GPU to be done with the frame that last used the region
+  GLsync fence = ring->fences[ring->frame];
+  if (!fence)
+    return;
+  GLenum status = glClientWaitSync(fence, 0, 0);  // Check without flushing first, usually it's long done
+  if (status == GL_TIMEOUT_EXPIRED) {
+    ring->stalls++;
+    do
+      status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, STREAM_RING_WAIT_NS);
+    while (status == GL_TIMEOUT_EXPIRED);
+  }
+  if (status == GL_WAIT_FAILED) {
+    fprintf(stderr, "Failed to wait on a stream ring fence\n");
+    exit(EXIT_FAILURE);
+  }
+  glDeleteSync(fence);
+  ring->fences[ring->frame] = NULL;
+}
 
-  // Delete the shaders since we have our program now
-  glDeleteShader(vertex);
-  glDeleteShader(fragment);
+void *mapStreamRing(stream_ring_t *ring, GLsizeiptr size, GLintptr *offset) {
+  assert(ring && offset && size > 0);
 
-  return program;  // Return the compiled and linked program
+  GLintptr head = streamRingStride(ring, ring->head);
+  if (head + size > (GLintptr)(ring->frame + 1) * ring->frame_size) {
+    fprintf(stderr, "A frame's data doesn't fit in its stream ring region, raise STREAM_RING_FRAME_BYTES\n");
+    exit(EXIT_FAILURE);
+  }
+  ring->head = head + size;
+  *offset = head;
+
+  if (ring->mapping)
+    return ring->mapping + head;
+
+  // Nothing reads the range until the fence of the region signals, so there is no need for the driver to check
+  bindBuffer(GL_COPY_WRITE_BUFFER, ring->buffer);
+  void *data = glMapBufferRange(GL_COPY_WRITE_BUFFER, head, size,
+    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  if (!data) {
+    fprintf(stderr, "Failed to map %ld bytes of a stream ring\n", (long)size);
+    exit(EXIT_FAILURE);
+  }
+  return data;
 }
 
-void setUniformVec4(GLuint program, const char *uniform_name, vec4 vector) {
-  glUniform4fv(glGetUniformLocation(program, uniform_name), 1, vector);
+void unmapStreamRing(stream_ring_t *ring) {
+  assert(ring);
+  if (ring->mapping)
+    return;   // Persistent mappings stay put while drawing
+  bindBuffer(GL_COPY_WRITE_BUFFER, ring->buffer);
+  glUnmapBuffer(GL_COPY_WRITE_BUFFER);
 }
 
-void setUniformMat4(GLuint program, const char *uniform_name, mat4 matrix) {
-  glUniformMatrix4fv(glGetUniformLocation(program, uniform_name), 1, GL_FALSE, (GLfloat *)matrix);
+void endStreamRingFrame(stream_ring_t *ring) {
+  assert(ring);
+  if (ring->fences[ring->frame])
+    glDeleteSync(ring->fences[ring->frame]);  // Ended twice, the new fence covers both
+  ring->fences[ring->frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 }
 
-void setUniformInt(GLuint program, const char *uniform_name, int v) {
-  glUniform1i(glGetUniformLocation(program, uniform_name), v);
+void freeStreamRing(stream_ring_t *ring) {
+  if (ring) {
+    for (GLuint frame = 0; frame < STREAM_RING_FRAMES; frame++) {
+      if (ring->fences[frame])
+        glDeleteSync(ring->fences[frame]);
+      ring->fences[frame] = NULL;
+    }
+    if (ring->mapping) {
+      bindBuffer(GL_COPY_WRITE_BUFFER, ring->buffer);
+      glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+      ring->mapping = NULL;
+    }
+    forgetBuffer(ring->buffer);
+    glDeleteBuffers(1, &ring->buffer);
+    ring->buffer = GL_NONE;
+  }
 }
 
 // TEXTURE FUNCTIONS //
@@ -167,8 +1583,7 @@ texture_t createTexture2DFromImage(
 
   // Build a new texture and set it up with OpenGL
   glGenTextures(1, &texture.id);
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, texture.id);   
+  bindTexture2D(0, texture.id);
 
   // Set the horizontal and vertical wrapping mode
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap_s);
@@ -190,7 +1605,7 @@ texture_t createTexture2DFromImage(
   glGenerateMipmap(GL_TEXTURE_2D);
 
   // Unbind the texture from tex unit 0 (technically not required but makes me rest easy)
-  glBindTexture(GL_TEXTURE_2D, GL_NONE);
+  bindTexture2D(0, GL_NONE);
 
   stbi_image_free(data);  // Free the image data to prevent a memory leak
 
@@ -200,6 +1615,7 @@ texture_t createTexture2DFromImage(
 void freeTexture(texture_t *texture) {
   // Reset the texture to its null state
   if (texture) {
+    forgetTexture(texture->id);
     glDeleteTextures(1, &(texture->id));
     texture->width = 0;
     texture->height = 0;
@@ -210,13 +1626,73 @@ void freeTexture(texture_t *texture) {
 // MESH FUNCTIONS //
 
 mesh_t buildSphereMesh(GLfloat radius, GLuint stacks, GLuint sectors) {
+  mesh_t sphere;  // The mesh we are going to return
+
+  // Try the cache first
+  char path[MESH_CACHE_PATH_SIZE];
+  getSphereCachePath(path, sizeof(path), MESH_CACHE_DIRECTORY, radius, stacks, sectors);
+  if (loadCachedMesh(path, &sphere))
+    return sphere;
+
+  // Build it and cache it for next time
+  mesh_blob_t *blob = bakeSphereMesh(radius, stacks, sectors);
+  saveMeshBlob(path, blob);   // Not being able to cache it isn't an error
+  sphere = uploadMeshBlob(blob);
+  free(blob);
+
+  return sphere;  // Return the sphere created
+}
+
+mesh_t buildIcosphereMesh(GLfloat radius, GLuint subdivisions) {
+  mesh_t icosphere;   // The mesh we are going to return
+
+  // Try the cache first
+  char path[MESH_CACHE_PATH_SIZE];
+  getIcosphereCachePath(path, sizeof(path), MESH_CACHE_DIRECTORY, radius, subdivisions);
+  if (loadCachedMesh(path, &icosphere))
+    return icosphere;
+
+  // Build it and cache it for next time
+  mesh_blob_t *blob = bakeIcosphereMesh(radius, subdivisions);
+  saveMeshBlob(path, blob);   // Not being able to cache it isn't an error
+  icosphere = uploadMeshBlob(blob);
+  free(blob);
+
+  return icosphere; // Return the icosphere created
+}
+
+mesh_t buildProceduralSphereMesh(GLuint stacks, GLuint sectors) {
+  // Assert the inputs are in range
+  assert(sectors >= 2);
+  assert(stacks >= 3);
+
+  mesh_t sphere;  // The mesh we are going to return
+
+  // There is nothing to put in VRAM, every quad of the stacks and sectors grid is two triangles made up in vertex.glsl
+  sphere.vbo = GL_NONE;
+  sphere.ebo = GL_NONE;
+  sphere.base_vertex = 0;
+  sphere.element_offset = 0;
+  sphere.draw_mode = GL_TRIANGLES;
+  sphere.vertex_count = (GLsizei)(stacks * sectors * 6);
+  sphere.element_count = 0;
+  sphere.index_type = GL_NONE;
+  sphere.vertex_format = VERTEX_FORMAT_PROCEDURAL_SPHERE;
+  sphere.position_scale = 1.0f;
+  sphere.stacks = stacks;
+  sphere.sectors = sectors;
+
+  return sphere;  // Return the sphere created
+}
+
+mesh_blob_t *bakeSphereMesh(GLfloat radius, GLuint stacks, GLuint sectors) {
   // Assert the inputs are in range
   assert(sectors >= 2);
   assert(stacks >= 3);
   assert(radius > 0.0f);
 
   // Fields
-  mesh_t sphere;  // The mesh we are going to return
+  mesh_t sphere;  // The layout of the sphere
   vertex_t *vertex_array = NULL;  // The vertex array to build
   GLuint *element_array = NULL;   // The element array to build
 
@@ -227,15 +1703,11 @@ mesh_t buildSphereMesh(GLfloat radius, GLuint stacks, GLuint sectors) {
   vertex_array = (vertex_t *)malloc(sizeof(vertex_t) * sphere.vertex_count);
 
   // Compute the number of elements to appear in the sphere
-  sphere.element_count = stacks * ((sectors - 2) * 6 + 2 * 3);
+  sphere.element_count = sectors * (stacks - 2) * 6 + 2 * sectors * 3;  // The first and last stacks are fans
 
   // Allocate memory for the element array
   element_array = (GLuint *)malloc(sizeof(GLuint) * sphere.element_count);
 
-  // Create a new VBO and EBO for the mesh
-  glGenBuffers(1, &(sphere.vbo));
-  glGenBuffers(1, &(sphere.ebo));
-
   // Set the draw mode of the mesh
   sphere.draw_mode = GL_TRIANGLES;
 
@@ -321,57 +1793,648 @@ mesh_t buildSphereMesh(GLfloat radius, GLuint stacks, GLuint sectors) {
     }
   }
 
-  // Send the vertex and element data to the vbo and ebo
-
-  // Bind the vertex buffer object
-  glBindBuffer(GL_ARRAY_BUFFER, sphere.vbo);
-  glBufferData(GL_ARRAY_BUFFER, sphere.vertex_count * sizeof(vertex_t), vertex_array, GL_STATIC_DRAW);
-
-  // Bind the element buffer object
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sphere.ebo);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sphere.element_count * sizeof(GLuint), element_array, GL_STATIC_DRAW);
+  // Optimize and pack the vertex and element data
+  mesh_blob_t *blob = packMesh(&sphere, vertex_array, element_array);
 
   // Free the bytes of vertex_array and element_array since we no longer need them
   free(vertex_array);
   free(element_array);
 
-  return sphere;  // Return the sphere created
+  return blob;  // Return the sphere baked
 }
 
-mesh_t buildIcosphereMesh(GLfloat radius, GLuint subdivisions) {
+mesh_blob_t *bakeIcosphereMesh(GLfloat radius, GLuint subdivisions) {
+  // Assert the inputs are in range
+  assert(radius > 0.0f);
+  assert(subdivisions <= 10);   // Past this the element count no longer fits in a GLsizei
+
   // Fields
-  mesh_t icosphere;
+  mesh_t icosphere;   // The layout of the icosphere
   
   /**
-   * @brief This code for sphere construction is courtesy of Song Ho Ahn and at the time
-   * of writing this program can be found and explained here: http://www.songho.ca/opengl/gl_sphere.html
-   * Aside from some minor changes, the code here is identical to it.
+   * @brief The base icosahedron follows Song Ho Ahn's construction found here: http://www.songho.ca/opengl/gl_sphere.html
+   * Each subdivision splits every triangle into four. Edge midpoints are shared between the two triangles on an
+   * edge through a midpoint cache so no vertex is ever duplicated, which means the vertex and element counts for
+   * every level are known up front:
+   *    faces = 20 * 4^n, edges = 30 * 4^n, vertices = 10 * 4^n + 2
    */
 
   // Variables for Icosphere creation
   const float H_ANGLE = GLM_PIf / 180.0f * 72.0f;   // 72 degrees
   const float V_ANGLE = atanf(1.0f / 2.0f);         // Elevation = 26.565 degrees
 
-  /*
-    TODO: Figure out how to create an Icosphere in C.
-  */ 
+  GLuint face_count = 20u << (2 * subdivisions);
+  GLuint shared_count = 10u * (1u << (2 * subdivisions)) + 2;
 
+  vec3 *positions = (vec3 *)malloc(sizeof(vec3) * shared_count);   // Positions of the shared vertices
+  GLuint *faces = (GLuint *)malloc(sizeof(GLuint) * 3 * face_count);  // Triangles of the current level
+  GLuint *next_faces = (GLuint *)malloc(sizeof(GLuint) * 3 * face_count);  // Triangles of the next level
+  assert(positions && faces && next_faces);
 
-  return icosphere; // Return the icosphere created
+  /**
+   * @brief Build the 12 vertices and 20 faces of the icosahedron here. Vertex 0 is the north pole, 1-5 are the
+   * upper ring, 6-10 are the lower ring (rotated half a step) and 11 is the south pole
+   * 
+   */
+  GLuint count = 0;   // The number of positions so far
+  glm_vec3_copy((vec3){0.0f, 0.0f, radius}, positions[count++]);
+  for (int i = 0; i < 5; i++) {
+    float angle = -GLM_PIf / 2 - H_ANGLE / 2 + i * H_ANGLE;
+    positions[count][0] = radius * cosf(V_ANGLE) * cosf(angle);
+    positions[count][1] = radius * cosf(V_ANGLE) * sinf(angle);
+    positions[count++][2] = radius * sinf(V_ANGLE);
+  }
+  for (int i = 0; i < 5; i++) {
+    float angle = -GLM_PIf / 2 + i * H_ANGLE;
+    positions[count][0] = radius * cosf(V_ANGLE) * cosf(angle);
+    positions[count][1] = radius * cosf(V_ANGLE) * sinf(angle);
+    positions[count++][2] = -radius * sinf(V_ANGLE);
+  }
+  glm_vec3_copy((vec3){0.0f, 0.0f, -radius}, positions[count++]);
+
+  GLuint *face = faces;
+  for (GLuint i = 0; i < 5; i++) {
+    GLuint upper = 1 + i, upper_next = 1 + (i + 1) % 5;
+    GLuint lower = 6 + i, lower_next = 6 + (i + 1) % 5;
+
+    *face++ = 0;          *face++ = upper;  *face++ = upper_next;   // Around the north pole
+    *face++ = upper;      *face++ = lower;  *face++ = upper_next;   // Pointing down from the upper ring
+    *face++ = upper_next; *face++ = lower;  *face++ = lower_next;   // Pointing up from the lower ring
+    *face++ = lower;      *face++ = 11;     *face++ = lower_next;   // Around the south pole
+  }
+
+  /**
+   * @brief Subdivide here. The midpoint cache only has to hold the edges of the level being split, so it is sized
+   * once for the last level (at most half full) and cleared between levels.
+   * 
+   */
+  midpoint_cache_t cache;
+  size_t slots = 64;
+  while (slots < 2 * (size_t)(30u << (2 * subdivisions)) / 4)
+    slots <<= 1;
+  cache.keys = (uint64_t *)malloc(sizeof(uint64_t) * slots);
+  cache.values = (GLuint *)malloc(sizeof(GLuint) * slots);
+  cache.mask = slots - 1;
+  assert(cache.keys && cache.values);
+
+  GLuint level_faces = 20;
+  for (GLuint level = 0; level < subdivisions; level++) {
+    memset(cache.keys, 0xFF, sizeof(uint64_t) * slots);   // Every slot to EMPTY_EDGE
+
+    GLuint *src = faces, *dst = next_faces;
+    for (GLuint f = 0; f < level_faces; f++, src += 3) {
+      GLuint a = src[0], b = src[1], c = src[2];
+      GLuint ab = getMidpoint(&cache, positions, &count, radius, a, b);
+      GLuint bc = getMidpoint(&cache, positions, &count, radius, b, c);
+      GLuint ca = getMidpoint(&cache, positions, &count, radius, c, a);
+
+      // Four triangles with the same winding as the parent
+      *dst++ = a;   *dst++ = ab;  *dst++ = ca;
+      *dst++ = ab;  *dst++ = b;   *dst++ = bc;
+      *dst++ = ca;  *dst++ = bc;  *dst++ = c;
+      *dst++ = ab;  *dst++ = bc;  *dst++ = ca;
+    }
+
+    // Swap the buffers
+    GLuint *tmp = faces;
+    faces = next_faces;
+    next_faces = tmp;
+    level_faces *= 4;
+  }
+  assert(count == shared_count && level_faces == face_count);
+
+  free(cache.keys);
+  free(cache.values);
+  free(next_faces);
+
+  /**
+   * @brief Texture coordinates can't be fully shared on a sphere. Triangles that straddle the u = 0/1 seam need
+   * copies of their u < 0.5 vertices with u + 1, and each triangle touching a pole needs its own pole vertex with u
+   * in the middle of the triangle. Count those first so the vertex array can be allocated exactly.
+   * 
+   */
+  float *u = (float *)malloc(sizeof(float) * shared_count);   // The u coordinate of every shared vertex
+  GLuint *seam_copy = (GLuint *)malloc(sizeof(GLuint) * shared_count);  // The seam copy of each vertex (0 = none)
+  assert(u && seam_copy);
+  for (GLuint i = 0; i < shared_count; i++) {
+    u[i] = sphereU(positions[i]);
+    seam_copy[i] = 0;
+  }
+
+  GLuint extra_count = 0;
+  for (GLuint f = 0; f < face_count; f++) {
+    GLuint *tri = faces + 3 * f;
+    float u_min = 1.0f, u_max = 0.0f;
+    for (int k = 0; k < 3; k++) {
+      if (tri[k] == 0 || tri[k] == 11)
+        continue;
+      u_min = fminf(u_min, u[tri[k]]);
+      u_max = fmaxf(u_max, u[tri[k]]);
+    }
+    for (int k = 0; k < 3; k++) {
+      if (tri[k] == 0 || tri[k] == 11)
+        extra_count++;   // One pole vertex per triangle
+      else if (u_max - u_min > 0.5f && u[tri[k]] < 0.5f && !seam_copy[tri[k]]) {
+        seam_copy[tri[k]] = 1;  // Mark for now, assign an index below
+        extra_count++;
+      }
+    }
+  }
+
+  icosphere.vertex_count = shared_count + extra_count;
+  icosphere.element_count = 3 * face_count;
+  icosphere.draw_mode = GL_TRIANGLES;
+
+  vertex_t *vertex_array = (vertex_t *)malloc(sizeof(vertex_t) * icosphere.vertex_count);
+  assert(vertex_array);
+
+  // Fill in the shared vertices
+  float length_inv = 1.0f / radius;
+  for (GLuint i = 0; i < shared_count; i++) {
+    glm_vec3_copy(positions[i], vertex_array[i].position);
+    glm_vec3_scale(positions[i], length_inv, vertex_array[i].normal);
+    vertex_array[i].uv[0] = u[i];
+    vertex_array[i].uv[1] = acosf(glm_clamp(positions[i][2] * length_inv, -1.0f, 1.0f)) / GLM_PIf;
+  }
+
+  // Make the seam copies
+  GLuint next = shared_count;
+  for (GLuint i = 0; i < shared_count; i++) {
+    if (seam_copy[i]) {
+      seam_copy[i] = next;
+      vertex_array[next] = vertex_array[i];
+      vertex_array[next++].uv[0] += 1.0f;
+    }
+  }
+
+  // Point the triangles at the copies
+  for (GLuint f = 0; f < face_count; f++) {
+    GLuint *tri = faces + 3 * f;
+    float u_min = 1.0f, u_max = 0.0f;
+    for (int k = 0; k < 3; k++) {
+      if (tri[k] == 0 || tri[k] == 11)
+        continue;
+      u_min = fminf(u_min, u[tri[k]]);
+      u_max = fmaxf(u_max, u[tri[k]]);
+    }
+
+    if (u_max - u_min > 0.5f)
+      for (int k = 0; k < 3; k++)
+        if (tri[k] != 0 && tri[k] != 11 && u[tri[k]] < 0.5f)
+          tri[k] = seam_copy[tri[k]];
+
+    // Give each pole its own vertex centered between the other two
+    for (int k = 0; k < 3; k++) {
+      if (tri[k] == 0 || tri[k] == 11) {
+        GLuint pole = next++;
+        vertex_array[pole] = vertex_array[tri[k]];
+        vertex_array[pole].uv[0] = 0.5f * (vertex_array[tri[(k + 1) % 3]].uv[0] + vertex_array[tri[(k + 2) % 3]].uv[0]);
+        tri[k] = pole;
+      }
+    }
+  }
+  assert(next == (GLuint)icosphere.vertex_count);
+
+  // Optimize and pack the vertex and element data
+  mesh_blob_t *blob = packMesh(&icosphere, vertex_array, faces);
+
+  // Free everything since it's baked now
+  free(u);
+  free(seam_copy);
+  free(positions);
+  free(faces);
+  free(vertex_array);
+
+  return blob;  // Return the icosphere baked
+}
+
+void getSphereCachePath(char *dest, size_t size, const char *directory, GLfloat radius, GLuint stacks, GLuint sectors) {
+  // Key on the exact bits of the radius so no two radii share a file
+  uint32_t radius_bits; memcpy(&radius_bits, &radius, sizeof(radius_bits));
+  snprintf(dest, size, "%s/sphere-%08x-%u-%u.mesh", directory, radius_bits, stacks, sectors);
+}
+
+void getIcosphereCachePath(char *dest, size_t size, const char *directory, GLfloat radius, GLuint subdivisions) {
+  // Key on the exact bits of the radius so no two radii share a file
+  uint32_t radius_bits; memcpy(&radius_bits, &radius, sizeof(radius_bits));
+  snprintf(dest, size, "%s/icosphere-%08x-%u.mesh", directory, radius_bits, subdivisions);
+}
+
+bool saveMeshBlob(const char *path, const mesh_blob_t *blob) {
+  assert(path && blob);
+
+  char temp_path[MESH_CACHE_PATH_SIZE + 4];
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+  FILE *file = fopen(temp_path, "wb");
+  if (!file)
+    return false;
+
+  size_t size = sizeof(mesh_blob_t) + blob->vertex_bytes + blob->element_bytes;
+  bool written = fwrite(blob, 1, size, file) == size;
+  written = fclose(file) == 0 && written;
+
+  // Move it into place, or get rid of it if it didn't make it to disk
+  if (!written || rename(temp_path, path) != 0) {
+    remove(temp_path);
+    return false;
+  }
+
+  return true;
+}
+
+bool loadCachedMesh(const char *path, mesh_t *mesh) {
+  assert(path && mesh);
+
+  int file = open(path, O_RDONLY);
+  if (file < 0)
+    return false;   // Not baked yet
+
+  struct stat info;
+  if (fstat(file, &info) != 0 || (size_t)info.st_size < sizeof(mesh_blob_t)) {
+    close(file);
+    return false;
+  }
+
+  // Map the file so its data goes straight to glBufferData
+  const mesh_blob_t *blob = (const mesh_blob_t *)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (blob == MAP_FAILED)
+    return false;
+
+  // Only use it if it was baked by this version of the code in the format we draw with
+  bool valid = !memcmp(blob->magic, "RTSM", 4) && blob->version == MESH_CACHE_VERSION &&
+    blob->vertex_format == DEFAULT_VERTEX_FORMAT &&
+    sizeof(mesh_blob_t) + blob->vertex_bytes + blob->element_bytes == (uint64_t)info.st_size;
+  if (valid)
+    *mesh = uploadMeshBlob(blob);
+
+  munmap((void *)blob, info.st_size);
+
+  return valid;
+}
+
+mesh_t uploadMeshBlob(const mesh_blob_t *blob) {
+  assert(blob);
+
+  mesh_t mesh;  // The mesh to return
+
+  // Copy the layout from the header
+  mesh.draw_mode = blob->draw_mode;
+  mesh.index_type = blob->index_type;
+  mesh.vertex_format = (vertex_format_t)blob->vertex_format;
+  mesh.vertex_count = (GLsizei)blob->vertex_count;
+  mesh.element_count = (GLsizei)blob->element_count;
+  mesh.position_scale = blob->position_scale;
+  mesh.stacks = 0;
+  mesh.sectors = 0;
+
+  const unsigned char *vertex_data = (const unsigned char *)(blob + 1);
+  const unsigned char *element_data = vertex_data + blob->vertex_bytes;
+
+  // Vertices start on a multiple of their stride so the base vertex can find them, elements on a multiple of 4 bytes
+  GLsizeiptr stride = blob->vertex_format == VERTEX_FORMAT_PACKED ? sizeof(packed_vertex_t) : sizeof(vertex_t);
+  GLsizeiptr vertex_offset = (geometry_buffer.vertex_size + stride - 1) / stride * stride;
+  GLsizeiptr element_offset = (geometry_buffer.element_size + 3) & ~(GLsizeiptr)3;
+  if (geometry_buffer.vbo &&
+    vertex_offset + (GLsizeiptr)blob->vertex_bytes <= geometry_buffer.vertex_capacity &&
+    element_offset + (GLsizeiptr)blob->element_bytes <= geometry_buffer.element_capacity) {
+    // Suballocate the mesh from the geometry buffer
+    mesh.vbo = geometry_buffer.vbo;
+    mesh.ebo = geometry_buffer.ebo;
+    mesh.base_vertex = (GLint)(vertex_offset / stride);
+    mesh.element_offset = element_offset;
+
+    bindBuffer(GL_COPY_WRITE_BUFFER, mesh.vbo);  // Leaves the element buffer of the bound vao alone
+    glBufferSubData(GL_COPY_WRITE_BUFFER, vertex_offset, blob->vertex_bytes, vertex_data);
+    bindBuffer(GL_COPY_WRITE_BUFFER, mesh.ebo);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, element_offset, blob->element_bytes, element_data);
+
+    geometry_buffer.vertex_size = vertex_offset + blob->vertex_bytes;
+    geometry_buffer.element_size = element_offset + blob->element_bytes;
+    return mesh;
+  }
+
+  if (geometry_buffer.vbo)
+    fprintf(stderr, "Geometry buffer is full, giving a mesh of %u vertices its own buffers\n", blob->vertex_count);
+
+  // Create a new VBO and EBO for the mesh
+  glGenBuffers(1, &(mesh.vbo));
+  glGenBuffers(1, &(mesh.ebo));
+  mesh.base_vertex = 0;
+  mesh.element_offset = 0;
+
+  // Fill the vertex buffer object
+  bindBuffer(GL_COPY_WRITE_BUFFER, mesh.vbo);
+  glBufferData(GL_COPY_WRITE_BUFFER, blob->vertex_bytes, vertex_data, GL_STATIC_DRAW);
+
+  // Fill the element buffer object
+  bindBuffer(GL_COPY_WRITE_BUFFER, mesh.ebo);
+  glBufferData(GL_COPY_WRITE_BUFFER, blob->element_bytes, element_data, GL_STATIC_DRAW);
+
+  return mesh;
+}
+
+float computeACMR(const GLuint *elements, GLsizei element_count, GLsizei vertex_count, GLuint cache_size) {
+  assert(elements && element_count % 3 == 0 && cache_size > 0);
+
+  if (element_count == 0)
+    return 0.0f;
+
+  // A vertex is in the FIFO if fewer than cache_size misses have happened since it was added
+  GLuint *added_at = (GLuint *)calloc(vertex_count, sizeof(GLuint));  // The miss count when added (0 if never)
+  assert(added_at);
+
+  GLuint misses = 0;
+  for (GLsizei i = 0; i < element_count; i++) {
+    GLuint v = elements[i];
+    if (!added_at[v] || misses - added_at[v] >= cache_size)
+      added_at[v] = ++misses;
+  }
+
+  free(added_at);
+
+  return (float)misses / (float)(element_count / 3);
+}
+
+void optimizeVertexCache(GLuint *elements, GLsizei element_count, GLsizei vertex_count) {
+  assert(elements && element_count % 3 == 0);
+
+  GLsizei triangle_count = element_count / 3;
+  if (triangle_count == 0)
+    return;
+
+  // Per vertex state
+  GLuint *remaining = (GLuint *)calloc(vertex_count, sizeof(GLuint));         // Triangles left to add
+  GLuint *offsets = (GLuint *)malloc(sizeof(GLuint) * (vertex_count + 1));    // Where each adjacency list starts
+  GLint *cache_position = (GLint *)malloc(sizeof(GLint) * vertex_count);      // Position in the cache (-1 if none)
+  float *vertex_score = (float *)malloc(sizeof(float) * vertex_count);
+
+  // Per triangle state
+  GLuint *adjacency = (GLuint *)malloc(sizeof(GLuint) * element_count);      // The triangles using each vertex
+  float *triangle_score = (float *)malloc(sizeof(float) * triangle_count);
+  bool *added = (bool *)calloc(triangle_count, sizeof(bool));
+  GLuint *output = (GLuint *)malloc(sizeof(GLuint) * element_count);
+  assert(remaining && offsets && cache_position && vertex_score && adjacency && triangle_score && added && output);
+
+  // Build the adjacency lists. Each vertex's list keeps its unadded triangles in the first remaining entries.
+  for (GLsizei i = 0; i < element_count; i++)
+    remaining[elements[i]]++;
+  offsets[0] = 0;
+  for (GLsizei v = 0; v < vertex_count; v++)
+    offsets[v + 1] = offsets[v] + remaining[v];
+  memset(remaining, 0, sizeof(GLuint) * vertex_count);
+  for (GLsizei i = 0; i < element_count; i++) {
+    GLuint v = elements[i];
+    adjacency[offsets[v] + remaining[v]++] = (GLuint)(i / 3);
+  }
+
+  // Score everything with an empty cache
+  for (GLsizei v = 0; v < vertex_count; v++) {
+    cache_position[v] = -1;
+    vertex_score[v] = forsythVertexScore(-1, remaining[v]);
+  }
+  GLsizei best = 0;   // The next triangle to add
+  for (GLsizei t = 0; t < triangle_count; t++) {
+    const GLuint *triangle = &elements[3 * t];
+    triangle_score[t] = vertex_score[triangle[0]] + vertex_score[triangle[1]] + vertex_score[triangle[2]];
+    if (triangle_score[t] > triangle_score[best])
+      best = t;
+  }
+
+  GLuint cache[FORSYTH_CACHE_SIZE + 3];   // The cache, most recent first, with room for the vertices pushed out
+  GLuint cache_count = 0;
+  GLsizei scan = 0;   // Where to look for an unadded triangle when the cache runs dry
+
+  for (GLsizei i = 0; i < triangle_count; i++) {
+    // Nothing in the cache has triangles left, so start again from the first unadded triangle
+    if (best < 0) {
+      while (added[scan])
+        scan++;
+      best = scan;
+    }
+
+    // Add the triangle and take it out of its vertices' adjacency lists
+    const GLuint *triangle = &elements[3 * best];
+    memcpy(&output[3 * i], triangle, sizeof(GLuint) * 3);
+    added[best] = true;
+    for (int k = 0; k < 3; k++) {
+      GLuint v = triangle[k];
+      GLuint *list = &adjacency[offsets[v]];
+      for (GLuint j = 0; j < remaining[v]; j++) {
+        if (list[j] == (GLuint)best) {
+          list[j] = list[--remaining[v]];
+          break;
+        }
+      }
+    }
+
+    // Move the triangle's vertices to the front of the cache
+    GLuint new_cache[FORSYTH_CACHE_SIZE + 3];
+    GLuint new_count = 0;
+    for (int k = 0; k < 3; k++)
+      new_cache[new_count++] = triangle[k];
+    for (GLuint j = 0; j < cache_count; j++) {
+      GLuint v = cache[j];
+      if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+        new_cache[new_count++] = v;
+    }
+
+    // Rescore the vertices that moved, including the ones pushed out the back
+    for (GLuint j = 0; j < new_count; j++) {
+      GLuint v = new_cache[j];
+      cache_position[v] = j < FORSYTH_CACHE_SIZE ? (GLint)j : -1;
+      vertex_score[v] = forsythVertexScore(cache_position[v], remaining[v]);
+    }
+    cache_count = new_count < FORSYTH_CACHE_SIZE ? new_count : FORSYTH_CACHE_SIZE;
+    memcpy(cache, new_cache, sizeof(GLuint) * cache_count);
+
+    // Rescore the triangles touching the cache and pick the best of them to add next
+    best = -1;
+    float best_score = -1.0f;
+    for (GLuint j = 0; j < new_count; j++) {
+      GLuint v = new_cache[j];
+      const GLuint *list = &adjacency[offsets[v]];
+      for (GLuint k = 0; k < remaining[v]; k++) {
+        GLuint t = list[k];
+        const GLuint *candidate = &elements[3 * t];
+        triangle_score[t] = vertex_score[candidate[0]] + vertex_score[candidate[1]] + vertex_score[candidate[2]];
+        if (triangle_score[t] > best_score) {
+          best_score = triangle_score[t];
+          best = (GLsizei)t;
+        }
+      }
+    }
+  }
+
+  memcpy(elements, output, sizeof(GLuint) * element_count);
+
+  free(remaining);
+  free(offsets);
+  free(cache_position);
+  free(vertex_score);
+  free(adjacency);
+  free(triangle_score);
+  free(added);
+  free(output);
+}
+
+void optimizeVertexFetch(vertex_t *vertices, GLsizei vertex_count, GLuint *elements, GLsizei element_count) {
+  assert(vertices && elements);
+
+  GLuint *remap = (GLuint *)malloc(sizeof(GLuint) * vertex_count);          // The new index of each vertex
+  vertex_t *reordered = (vertex_t *)malloc(sizeof(vertex_t) * vertex_count);
+  assert(remap && reordered);
+
+  // Number the vertices in the order they are first used
+  memset(remap, 0xff, sizeof(GLuint) * vertex_count);
+  GLuint next = 0;
+  for (GLsizei i = 0; i < element_count; i++) {
+    GLuint v = elements[i];
+    if (remap[v] == UINT32_MAX)
+      remap[v] = next++;
+    elements[i] = remap[v];
+  }
+
+  // Unused vertices go at the end
+  for (GLsizei v = 0; v < vertex_count; v++)
+    if (remap[v] == UINT32_MAX)
+      remap[v] = next++;
+
+  for (GLsizei v = 0; v < vertex_count; v++)
+    reordered[remap[v]] = vertices[v];
+  memcpy(vertices, reordered, sizeof(vertex_t) * vertex_count);
+
+  free(remap);
+  free(reordered);
+}
+
+void optimizeMesh(vertex_t *vertices, GLsizei vertex_count, GLuint *elements, GLsizei element_count) {
+  float acmr_before = computeACMR(elements, element_count, vertex_count, ACMR_CACHE_SIZE);
+
+  optimizeVertexCache(elements, element_count, vertex_count);
+  optimizeVertexFetch(vertices, vertex_count, elements, element_count);
+
+  if (REPORT_MESH_OPTIMIZATION)
+    printf("Mesh with %d vertices and %d triangles: ACMR %.3f -> %.3f\n", vertex_count, element_count / 3,
+      acmr_before, computeACMR(elements, element_count, vertex_count, ACMR_CACHE_SIZE));
+}
+
+mesh_lod_t buildIcosphereLODs(GLfloat radius, GLuint subdivisions, GLuint count, float pixel_error) {
+  assert(count >= 1 && count <= MAX_MESH_LODS && count <= subdivisions + 1);
+  assert(pixel_error > 0.0f);
+
+  mesh_lod_t lods;  // The chain to build
+  lods.count = count;
+
+  for (GLuint i = 0; i < count; i++) {
+    GLuint level = subdivisions - i;
+    lods.levels[i] = buildIcosphereMesh(radius, level);
+
+    /**
+     * @brief An icosahedron edge spans ~1.107 radians and each subdivision halves it. A chord spanning theta sits
+     * r * (1 - cos(theta / 2)) ~= r * theta^2 / 8 inside the sphere, so on screen the error stays under pixel_error
+     * as long as the projected radius stays under 8 * pixel_error / theta^2.
+     */
+    float theta = 1.1071487f / (float)(1u << level);
+    lods.max_radius[i] = 8.0f * pixel_error / (theta * theta);
+  }
+  lods.max_radius[0] = INFINITY;  // Nothing more detailed to switch to
+
+  return lods;
+}
+
+mesh_lod_t buildProceduralSphereLODs(GLuint stacks, GLuint count, float pixel_error) {
+  assert(count >= 1 && count <= MAX_MESH_LODS && (stacks >> (count - 1)) >= 3);
+  assert(pixel_error > 0.0f);
+
+  mesh_lod_t lods;  // The chain to build
+  lods.count = count;
+
+  for (GLuint i = 0; i < count; i++) {
+    GLuint level_stacks = stacks >> i;
+    lods.levels[i] = buildProceduralSphereMesh(level_stacks, 2 * level_stacks);
+
+    // With twice as many sectors as stacks every edge spans at most pi / stacks (see buildIcosphereLODs)
+    float theta = GLM_PIf / (float)level_stacks;
+    lods.max_radius[i] = 8.0f * pixel_error / (theta * theta);
+  }
+  lods.max_radius[0] = INFINITY;  // Nothing more detailed to switch to
+
+  return lods;
+}
+
+GLuint selectLOD(const mesh_lod_t *lods, float screen_radius, GLuint current) {
+  assert(lods && lods->count > 0);
+
+  GLuint lod = current < lods->count ? current : lods->count - 1;
+
+  // Add detail right away
+  while (lod > 0 && screen_radius > lods->max_radius[lod])
+    lod--;
+
+  // Only drop detail once we're comfortably below the next threshold
+  while (lod + 1 < lods->count && screen_radius < lods->max_radius[lod + 1] * (1.0f - DEFAULT_LOD_HYSTERESIS))
+    lod++;
+
+  return lod;
+}
+
+void freeMeshLODs(mesh_lod_t *lods) {
+  if (lods) {
+    for (GLuint i = 0; i < lods->count; i++)
+      freeMesh(&(lods->levels[i]));
+    lods->count = 0;
+  }
+}
+
+void initGeometryBuffer(GLsizeiptr vertex_capacity, GLsizeiptr element_capacity) {
+  assert(!geometry_buffer.vbo && vertex_capacity > 0 && element_capacity > 0);
+
+  // Allocate both buffers up front, meshes are copied into them as they are uploaded
+  glGenBuffers(1, &geometry_buffer.vbo);
+  glGenBuffers(1, &geometry_buffer.ebo);
+  bindBuffer(GL_COPY_WRITE_BUFFER, geometry_buffer.vbo);
+  glBufferData(GL_COPY_WRITE_BUFFER, vertex_capacity, NULL, GL_STATIC_DRAW);
+  bindBuffer(GL_COPY_WRITE_BUFFER, geometry_buffer.ebo);
+  glBufferData(GL_COPY_WRITE_BUFFER, element_capacity, NULL, GL_STATIC_DRAW);
+
+  geometry_buffer.vertex_capacity = vertex_capacity;
+  geometry_buffer.element_capacity = element_capacity;
+  geometry_buffer.vertex_size = 0;
+  geometry_buffer.element_size = 0;
+}
+
+void freeGeometryBuffer(void) {
+  forgetBuffer(geometry_buffer.vbo);
+  forgetBuffer(geometry_buffer.ebo);
+  glDeleteBuffers(1, &geometry_buffer.vbo);
+  glDeleteBuffers(1, &geometry_buffer.ebo);
+  memset(&geometry_buffer, 0, sizeof(geometry_buffer_t));
 }
 
 void freeMesh(mesh_t *mesh) {
   // If pointer is valid
   if (mesh) {
-    glDeleteBuffers(1, &(mesh->vbo));   // Delete the vbo
-    glDeleteBuffers(1, &(mesh->ebo));   // Delete the ebo
+    // Meshes in the geometry buffer only let go of their range
+    if (mesh->vbo != geometry_buffer.vbo) {
+      forgetBuffer(mesh->vbo);
+      forgetBuffer(mesh->ebo);
+      glDeleteBuffers(1, &(mesh->vbo));   // Delete the vbo
+      glDeleteBuffers(1, &(mesh->ebo));   // Delete the ebo
+    }
 
     // Set everything to 0
     mesh->vbo = GL_NONE;
     mesh->ebo = GL_NONE;
+    mesh->base_vertex = 0;
+    mesh->element_offset = 0;
     mesh->draw_mode = GL_NONE;
     mesh->element_count = 0;
     mesh->vertex_count = 0;
+    mesh->index_type = GL_NONE;
+    mesh->stacks = 0;
+    mesh->sectors = 0;
   }
 }
 
@@ -384,6 +2447,66 @@ void interpolate(interpol_t state, float alpha, vec3 dest) {
   dest[2] = (state.curr[2] * alpha) + (state.prev[2] * (1.0f - alpha));
 }
 
+void interpolateStates(const interpol_t *states, float alpha, vec3 *dest, size_t count) {
+  assert(states && dest);
+
+  size_t i = 0;
+
+#ifdef CGLM_SSE_FP
+  /**
+   * @brief Four states are 24 contiguous floats (curr then prev of each), loaded as six full registers. They are
+   * shuffled into the curr and prev of four vec3s laid end to end, so the 12 results go out as three full stores.
+   * The result is computed the same way as interpolate, so both paths agree exactly
+   */
+  const __m128 a = _mm_set1_ps(alpha);
+  const __m128 b = _mm_set1_ps(1.0f - alpha);
+  for (; i + 4 <= count; i += 4) {
+    const float *src = (const float *)(states + i);
+    float *out = (float *)(dest + i);
+
+    // Six loads cover the four states: c0x c0y c0z p0x | p0y p0z c1x c1y | c1z p1x p1y p1z | ... for states 2 and 3
+    __m128 l0 = _mm_loadu_ps(src + 0);
+    __m128 l1 = _mm_loadu_ps(src + 4);
+    __m128 l2 = _mm_loadu_ps(src + 8);
+    __m128 l3 = _mm_loadu_ps(src + 12);
+    __m128 l4 = _mm_loadu_ps(src + 16);
+    __m128 l5 = _mm_loadu_ps(src + 20);
+
+    // Gather c0x c0y c0z c1x | c1y c1z c2x c2y | c2z c3x c3y c3z and the same for prev
+    __m128 c0 = _mm_shuffle_ps(l0, _mm_shuffle_ps(l0, l1, _MM_SHUFFLE(2, 2, 2, 2)), _MM_SHUFFLE(2, 0, 1, 0));
+    __m128 c1 = _mm_shuffle_ps(_mm_shuffle_ps(l1, l2, _MM_SHUFFLE(0, 0, 3, 3)), l3, _MM_SHUFFLE(1, 0, 2, 0));
+    __m128 c2 = _mm_shuffle_ps(_mm_shuffle_ps(l3, l4, _MM_SHUFFLE(2, 2, 2, 2)),
+      _mm_shuffle_ps(l4, l5, _MM_SHUFFLE(0, 0, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 p0 = _mm_shuffle_ps(_mm_shuffle_ps(l0, l1, _MM_SHUFFLE(0, 0, 3, 3)),
+      _mm_shuffle_ps(l1, l2, _MM_SHUFFLE(1, 1, 1, 1)), _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 p1 = _mm_shuffle_ps(l2, _mm_shuffle_ps(l3, l4, _MM_SHUFFLE(0, 0, 3, 3)), _MM_SHUFFLE(2, 0, 3, 2));
+    __m128 p2 = _mm_shuffle_ps(_mm_shuffle_ps(l4, l5, _MM_SHUFFLE(1, 1, 1, 1)), l5, _MM_SHUFFLE(3, 2, 2, 0));
+
+    _mm_storeu_ps(out + 0, _mm_add_ps(_mm_mul_ps(c0, a), _mm_mul_ps(p0, b)));
+    _mm_storeu_ps(out + 4, _mm_add_ps(_mm_mul_ps(c1, a), _mm_mul_ps(p1, b)));
+    _mm_storeu_ps(out + 8, _mm_add_ps(_mm_mul_ps(c2, a), _mm_mul_ps(p2, b)));
+  }
+#endif
+
+  for (; i < count; i++)
+    interpolate(states[i], alpha, dest[i]);
+}
+
+void interpolateOrientations(const interpol_quat_t *states, float alpha, versor *dest, size_t count) {
+  assert(states && dest);
+
+  size_t i = 0;
+
+#ifdef CGLM_SSE_FP
+  // Four orientations at a time
+  for (; i + 4 <= count; i += 4)
+    interpolateOrientationsx4(states + i, alpha, dest + i);
+#endif
+
+  // Whatever is left over
+  interpolateOrientationsScalar(states, alpha, dest, i, count);
+}
+
 // RENDERABLE FUNCTIONS //
 
 renderable_t buildRenderable(mesh_t mesh, texture_t texture, vec3 position, vec3 rotation, vec3 scale) {
@@ -391,13 +2514,14 @@ renderable_t buildRenderable(mesh_t mesh, texture_t texture, vec3 position, vec3
 
   // Copy trivial data
   renderable.mesh = mesh;
+  renderable.lods = NULL;
   renderable.texture = texture;
 
   // Copy vectors for the model matrix
   glm_vec3_copy(position, renderable.model_fields.position.curr);
   glm_vec3_copy(position, renderable.model_fields.position.prev);
-  glm_vec3_copy(rotation, renderable.model_fields.rotation.curr);
-  glm_vec3_copy(rotation, renderable.model_fields.rotation.prev);
+  buildOrientation(rotation, renderable.model_fields.orientation.curr);
+  glm_quat_copy(renderable.model_fields.orientation.curr, renderable.model_fields.orientation.prev);
   glm_vec3_copy(scale, renderable.model_fields.scale.curr);
   glm_vec3_copy(scale, renderable.model_fields.scale.prev);
 
@@ -415,8 +2539,8 @@ camera_t buildCamera(float fov, float aspect, float z_near, float z_far, vec3 po
   // Set projection matrix parameters
   camera.projection_fields.fov = fov;
   camera.projection_fields.aspect = aspect;
-  camera.projection_fields.z_far = z_near;
-  camera.projection_fields.z_near = z_far;
+  camera.projection_fields.z_near = z_near;
+  camera.projection_fields.z_far = z_far;
 
   // Copy vectors for the view matrix
   glm_vec3_copy(position, camera.view_fields.position.curr);
@@ -425,14 +2549,11 @@ camera_t buildCamera(float fov, float aspect, float z_near, float z_far, vec3 po
   glm_vec3_copy(up, camera.view_fields.up);
 
   // Build matrices
-  mat4 projection_matrix;
-  mat4 view_matrix;
-
-  glm_perspective(fov, aspect, z_near, z_far, projection_matrix);
-  glm_lookat(position, at, up, view_matrix);
+  glm_perspective(fov, aspect, z_near, z_far, camera.projection_matrix);
+  glm_lookat(position, at, up, camera.view_matrix);
 
   // View Projection matrix multiplication
-  glm_mat4_mul(projection_matrix, view_matrix, camera.view_projection_matrix);
+  glm_mat4_mul(camera.projection_matrix, camera.view_matrix, camera.view_projection_matrix);
 
   // Return camera
   return camera;
@@ -441,20 +2562,38 @@ camera_t buildCamera(float fov, float aspect, float z_near, float z_far, vec3 po
 // MATRIX FUNCTIONS //
 
 void buildModelMatrix(vec3 position, vec3 pivot, vec3 rotation, vec3 scale, mat4 model_matrix) {
-  vec3 combinedTranslation;   // The sum of position + pivot
-  glm_vec3_add(position, pivot, combinedTranslation);
+  versor orientation;   // The rotation as a quaternion (no gimbal lock)
+  buildOrientation(rotation, orientation);
+
+  // Build the matrix as a batch of one
+  buildModelMatrices((const vec3 *)position, (const versor *)orientation, (const vec3 *)scale, (const vec3 *)pivot,
+    (mat4 *)model_matrix, 1);
+}
+
+void buildOrientation(vec3 rotation, versor orientation) {
+  versor yaw, pitch, roll, yaw_pitch;  // One quaternion per axis
+
+  glm_quat(yaw, glm_rad(rotation[1]), 0.0f, 1.0f, 0.0f);    // Rotate around y axis
+  glm_quat(pitch, glm_rad(rotation[0]), 1.0f, 0.0f, 0.0f);  // Rotate around x axis
+  glm_quat(roll, glm_rad(rotation[2]), 0.0f, 0.0f, 1.0f);   // Rotate around z axis
+
+  // Same order as the old per axis glm_rotate calls: y * x * z
+  glm_quat_mul(yaw, pitch, yaw_pitch);
+  glm_quat_mul(yaw_pitch, roll, orientation);
+}
 
-  glm_mat4_identity(model_matrix);  // Initialize identity matrix
-  glm_translate(model_matrix, combinedTranslation);   // Move to pos + pivot
+void buildModelMatrices(
+  const vec3 *positions, const versor *orientations, const vec3 *scales, const vec3 *pivots, mat4 *model_matrices, size_t count) {
+  assert(positions && orientations && scales && model_matrices);
 
-  // TODO: These rotation calculations might cause a gimbal lock, consider using quaternions
-  glm_rotate(model_matrix, glm_rad(rotation[1]), (vec3){0.0f, 1.0f, 0.0f}); // Rotate around y axis
-  glm_rotate(model_matrix, glm_rad(rotation[0]), (vec3){1.0f, 0.0f, 0.0f}); // Rotate around x axis
-  glm_rotate(model_matrix, glm_rad(rotation[2]), (vec3){0.0f, 0.0f, 1.0f}); // Rotate around z axis
+  size_t i = 0;
 
-  glm_scale(model_matrix, scale); // Scale the matrix
+#ifdef CGLM_SSE_FP
+  // Four objects at a time
+  for (; i + 4 <= count; i += 4)
+    buildModelMatricesx4(positions + i, orientations + i, scales + i, pivots ? pivots + i : NULL, model_matrices + i);
+#endif
 
-  vec3 inv;   // Vector to bring us back to position
-  glm_vec3_scale(pivot, -1.0f, inv);
-  glm_translate(model_matrix, inv); // Translate back to the position
+  // Whatever is left over
+  buildModelMatricesScalar(positions, orientations, scales, pivots, model_matrices, i, count);
 }
\ No newline at end of file
@@ -20,6 +20,8 @@
 // VARIABLES // 
 
 bool is_running = true;   // Program is running by default
+int framebuffer_width = DEFAULT_WINDOW_WIDTH_PIXELS;    // Kept up to date by framebufferSizeCallback
+int framebuffer_height = DEFAULT_WINDOW_HEIGHT_PIXELS;  // Kept up to date by framebufferSizeCallback
 
 
 // FUNCTIONS //
@@ -125,6 +127,7 @@ int main(int argc, char **args) {
   float delta_time = 1.0f / DEFAULT_PHYS_TICKS_PER_SECOND;  // The delta time between phys steps
   float prev_time = glfwGetTime();    // Get the time in seconds
   float accumulator = 0.0f; // Accumulator for keeping phys steps and draw calls in sync
+  float report_time = prev_time;  // When the state cache counters were last reported
 
   // Application loop
   while (!glfwWindowShouldClose(window) && is_running) {
@@ -145,6 +148,14 @@ int main(int argc, char **args) {
     float alpha = accumulator / delta_time;
     drawScene(alpha);
 
+    // Report the last frame's state changes once a second
+    if (REPORT_GL_STATE_COUNTERS && curr_time - report_time >= 1.0f) {
+      gl_state_counters_t counters = getGLStateCounters();
+      printf("Binds: %u issued, %u elided. Uniforms: %u issued, %u elided\n",
+        counters.binds, counters.binds_elided, counters.uniforms, counters.uniforms_elided);
+      report_time = curr_time;
+    }
+
     glfwSwapBuffers(window);  // Update the window with the default framebuffer's contents
     glfwPollEvents();   // Poll for user events
   }
@@ -174,4 +185,8 @@ void processInput(GLFWwindow *window, int key, int scancode, int action, int mod
 
 void framebufferSizeCallback(GLFWwindow *window, int width, int height) {
   glViewport(0, 0, width, height);  // Update the viewport with the new screen dimensions
+
+  // Remember the new size
+  framebuffer_width = width;
+  framebuffer_height = height;
 }
\ No newline at end of file
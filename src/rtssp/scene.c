@@ -15,21 +15,818 @@
 #include "rtssp/scene.h"
 #include "rtssp/rtssp.h"
 
+#include <string.h>
+#include <assert.h>
+#include <float.h>
+#include <stddef.h>
+
 
 // LOCAL DATA //
 
+/**
+ * @brief A draw_batch_t is a run of instances in the instance buffer that are drawn with one instanced draw call.
+ * Bodies share a batch when they are drawn the same way with the same mesh and texture, i.e. their render queue
+ * keys only differ in depth and body.
+ * 
+ */
+typedef struct {
+  const mesh_t *mesh;   // The mesh every instance is drawn with (NULL for sphere impostors)
+  GLuint texture;       // The texture every instance is drawn with (0 for none)
+  GLuint first;         // The first instance of the batch
+  GLuint count;         // The number of instances in the batch
+  GLintptr block;       // Where its draw_block_t is in the stream ring this frame (procedural meshes only)
+} draw_batch_t;
+
+// The features the scene and impostor shaders are specialized on, each a #define of the shader variant instead of a
+// uniform the shader branches on. The bits index the feature names below.
+#define SCENE_FEATURE_TEXTURE               (1u << 0)   // Sample diffuse_map
+#define SCENE_FEATURE_OCTAHEDRAL_NORMALS    (1u << 1)   // The normals are packed with the octahedral mapping
+#define SCENE_FEATURE_PROCEDURAL_SPHERE     (1u << 2)   // Generate a unit sphere from gl_VertexID
+
+static const char *const scene_features[] = {"USE_TEXTURE", "OCTAHEDRAL_NORMALS", "PROCEDURAL_SPHERE"};
+static const char *const impostor_features[] = {"USE_TEXTURE"};   // SCENE_FEATURE_TEXTURE only
+
+// Every body drawn on the CPU queues a 64 bit key each frame. Sorting the keys puts the bodies drawn with the same
+// state next to each other, in the order the state is best changed in, and each batch front to back so early depth
+// testing skips as much shading as it can. From the most significant bit down:
+//   pass (2 bits)      Indexed meshes, then procedural meshes, then impostors (each pass has its own vao or program)
+//   texture (10 bits)  The texture slot
+//   state (4 bits)     The draw state slot of the mesh (its buffers and vertex layout)
+//   mesh (12 bits)     The mesh slot
+//   depth (16 bits)    The distance squared to the camera (the top bits of the float, which order like the float and
+//                      still tell apart distances 1% apart)
+//   (8 bits unused)
+//   body (12 bits)     The index of the body
+// Slots are handed out the first time a texture, draw state, or mesh is added to the scene. Keys are queued in order of
+// body, so the sort leaves the body bits out and only ever sorts the bits that differ between keys.
+#define DRAW_KEY_PASS_SHIFT     62
+#define DRAW_KEY_TEXTURE_SHIFT  52
+#define DRAW_KEY_STATE_SHIFT    48
+#define DRAW_KEY_MESH_SHIFT     36
+#define DRAW_KEY_DEPTH_SHIFT    20
+#define DRAW_KEY_BODY_BITS      12
+#define DRAW_KEY_BODY_MASK      ((1u << DRAW_KEY_BODY_BITS) - 1)
+
+#define DRAW_PASS_INDEXED       0   // Meshes with an ebo, multi drawn where possible
+#define DRAW_PASS_ARRAYS        1   // Meshes without an ebo (procedural spheres)
+#define DRAW_PASS_IMPOSTOR      2   // Ray traced sphere impostors
+
+#define MAX_QUEUE_TEXTURES      1024
+#define MAX_QUEUE_STATES        16  // Meshes past this many draw states share the last slot (it only orders them)
+#define MAX_QUEUE_MESHES        4096
+
+#if MAX_SCENE_BODIES > DRAW_KEY_BODY_MASK + 1 || MAX_SCENE_BODIES > MAX_QUEUE_TEXTURES
+#error "The render queue keys have no room for MAX_SCENE_BODIES bodies"
+#endif
+
+/**
+ * @brief A cull_candidate_t is a body handed to the culling compute shader, laid out like Candidate in
+ * cull/compute.glsl (std430)
+ * 
+ */
+typedef struct {
+  float model_matrix[16];   // The model matrix of the body (column major, a plain array so AVX can't realign it)
+  float radius;       // The radius of its bounding sphere
+  GLuint body;        // Its index in the body table
+  GLuint group;       // Its cull group
+  GLuint padding;     // Rounds the struct up to 16 bytes like std430 does
+} cull_candidate_t;
+
+// The host and shader strides have to agree however cglm aligns its types (mat4 is 32 byte aligned with AVX)
+_Static_assert(sizeof(cull_candidate_t) == 80, "cull_candidate_t must match Candidate in cull/compute.glsl (80 bytes)");
+_Static_assert(offsetof(cull_candidate_t, radius) == 64, "cull_candidate_t.radius must follow the 64 byte model matrix");
+
 static GLuint vao;        // The vertex array object
-static GLuint program;    // The shader program
+static GLuint procedural_vao;   // A vertex array object with only the instance attributes for meshes made in the vertex shader
+static shader_variants_t scene_variants;     // The variants of the scene shader program
+static shader_variants_t impostor_variants;  // The variants of the shader program for ray traced sphere impostors
+static draw_batch_t *batches;     // The draw batches of this frame, in render queue order
+static size_t batch_count;        // The number of draw batches this frame
+static uint64_t *draw_keys;       // The render queue of this frame
+static uint64_t *draw_key_scratch;  // Scratch space for sorting the render queue
+static mesh_t *queue_meshes;      // Every distinct mesh added to the scene, by mesh slot
+static GLuint *queue_mesh_states; // The draw state slot of each mesh slot
+static size_t queue_mesh_count;   // The number of mesh slots handed out
+static size_t queue_state_count;  // The number of draw state slots handed out
+static GLuint *queue_textures;    // Every distinct texture added to the scene, by texture slot
+static size_t queue_texture_count;  // The number of texture slots handed out
+static bool multi_draw_indirect;  // Whether indexed batches are drawn with glMultiDrawElementsIndirect
+static stream_ring_t stream_ring; // Where each frame's instances, draw commands, and uniform blocks are written
+static double scene_time;   // The simulation time after the last step (in seconds)
+static float scene_step;    // The length of the last step (in seconds)
+
+static bool gpu_culling;            // Whether default sphere bodies are culled by the culling compute shader
+static GLuint cull_program;         // The culling compute shader
+static GLuint lod_state_buffer;     // The level of detail the compute shader last picked for each body
+static GLintptr cull_command_offset;    // Where this frame's mesh draw commands are in the stream ring
+static GLintptr cull_impostor_offset;   // Where this frame's impostor draw commands are in the stream ring
+static GLuint culled_instance_buffer;   // The instances of the bodies that survive culling
+static draw_batch_t *cull_groups;       // The bodies culled on the GPU grouped by texture (mesh is unused)
+static size_t cull_group_count;         // The number of cull groups this frame
 
 
 // GLOBAL DATA //
 
+mesh_lod_t sphere_lods;   // The levels of detail for planets and suns etc.
 mesh_t default_sphere;  // The sphere mesh for planets and suns etc.
 camera_t camera;    // The camera for our scene
+highp_vec3 camera_position;   // The position of the camera in high precision
 phys_object_t sol;  // The sun at the center of the solar system
+body_table_t bodies;  // Every physics object in the scene
 
 // FUNCTIONS //
 
+// LOCAL FUNCTIONS //
+
+/**
+ * @brief Local helper that binds a mesh's vbo and ebo to the vao. The state cache remembers which vbo and vertex
+ * format the vao's attributes were set up with, so the attributes are only pointed again when either changes. Meshes
+ * in the geometry buffer all share one vbo and ebo, so drawing them never rebinds a buffer. Procedural meshes get
+ * procedural_vao, which only has the instance attributes, instead.
+ * 
+ * @param mesh  The mesh to bind
+ */
+static void bindMesh(const mesh_t *mesh) {
+  // Procedural meshes have no buffers, so they are drawn without any attributes enabled
+  if (mesh->vertex_format == VERTEX_FORMAT_PROCEDURAL_SPHERE) {
+    bindVertexArray(procedural_vao);
+    return;
+  }
+  bindVertexArray(vao);
+
+  if (vertexAttributesChanged(mesh->vbo, mesh->vertex_format)) {
+    bindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+    if (mesh->vertex_format == VERTEX_FORMAT_PACKED) {
+      // Position (snorm16, scaled back up through the MVP)
+      glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, sizeof(packed_vertex_t), (GLvoid *)0);
+      // Normal (octahedral snorm16, decoded by the vertex shader)
+      glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(packed_vertex_t), (GLvoid *)offsetof(packed_vertex_t, normal));
+      // Uv
+      glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(packed_vertex_t), (GLvoid *)offsetof(packed_vertex_t, uv));
+    }
+    else {
+      // Position
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (GLvoid *)0);
+      // Normal
+      glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (GLvoid *)offsetof(vertex_t, normal));
+      // Uv
+      glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (GLvoid *)offsetof(vertex_t, uv));
+    }
+  }
+
+  bindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ebo);
+}
+
+/**
+ * @brief Local helper that enables the instance attributes of the bound vao and makes them advance once per instance
+ * 
+ */
+static void enableInstanceAttributes(void) {
+  for (GLuint column = 0; column < 4; column++) {
+    glEnableVertexAttribArray(INSTANCE_ATTRIBUTE_LOCATION + column);
+    glVertexAttribDivisor(INSTANCE_ATTRIBUTE_LOCATION + column, 1);
+  }
+}
+
+/**
+ * @brief Local helper that points the instance attributes of the bound vao at a batch in an instance buffer.
+ * OpenGL 3.3 has no base instance for instanced draws, so each batch moves the attributes to its first instance.
+ * 
+ * @param buffer  The instance buffer
+ * @param first   The first instance of the batch
+ */
+static void setInstanceAttributes(GLuint buffer, GLuint first) {
+  bindBuffer(GL_ARRAY_BUFFER, buffer);
+  for (GLuint column = 0; column < 4; column++) {
+    glVertexAttribPointer(INSTANCE_ATTRIBUTE_LOCATION + column, 4, GL_FLOAT, GL_FALSE, sizeof(instance_t),
+      (GLvoid *)(first * sizeof(instance_t) + column * sizeof(vec4)));
+  }
+}
+
+/**
+ * @brief Local helper that maps room for this frame's instances in the stream ring. Instances are read straight from
+ * the ring, so batches refer to them by their index in the ring's buffer.
+ * 
+ * @param count     The number of instances
+ * @param first     Where to store the index of the first one in the ring's buffer
+ * @return instance_t*  Where to write them (write only, unmap the ring before drawing)
+ */
+static instance_t *mapInstances(size_t count, GLuint *first) {
+  GLintptr offset;
+  instance_t *data = (instance_t *)mapStreamRing(&stream_ring, sizeof(instance_t) * count, &offset);
+  *first = (GLuint)(offset / sizeof(instance_t));   // The ring's alignment is a multiple of sizeof(instance_t)
+  return data;
+}
+
+/**
+ * @brief Local helper that binds a texture (if there is one) to texture unit 0. Whether it is sampled is up to the
+ * shader variant.
+ * 
+ * @param texture   The texture to bind (0 for none)
+ */
+static void bindTexture(GLuint texture) {
+  if (texture)
+    bindTexture2D(0, texture);  // diffuse_map samples texture unit 0
+}
+
+/**
+ * @brief Local helper that checks whether a mesh is generated by the vertex shader, the only draws that read a draw
+ * block
+ * 
+ * @param mesh  The mesh drawn (NULL for sphere impostors)
+ * @return true   If it is a procedural sphere
+ * @return false  If its vertices are in a vbo
+ */
+static bool proceduralMesh(const mesh_t *mesh) {
+  return mesh && mesh->vertex_format == VERTEX_FORMAT_PROCEDURAL_SPHERE;
+}
+
+/**
+ * @brief Local helper that binds the variant of the scene shader program that draws a mesh with a texture
+ * 
+ * @param mesh      The mesh to draw
+ * @param texture   The texture to draw with (0 for none)
+ */
+static void useSceneVariant(const mesh_t *mesh, GLuint texture) {
+  GLuint features = texture ? SCENE_FEATURE_TEXTURE : 0;
+  if (mesh->vertex_format == VERTEX_FORMAT_PACKED)
+    features |= SCENE_FEATURE_OCTAHEDRAL_NORMALS;
+  else if (proceduralMesh(mesh))
+    features |= SCENE_FEATURE_PROCEDURAL_SPHERE;
+  useProgram(getShaderVariant(&scene_variants, features));
+}
+
+/**
+ * @brief Local helper that binds the variant of the impostor shader program that draws with a texture
+ * 
+ * @param texture   The texture to draw with (0 for none)
+ */
+static void useImpostorVariant(GLuint texture) {
+  useProgram(getShaderVariant(&impostor_variants, texture ? SCENE_FEATURE_TEXTURE : 0));
+}
+
+/**
+ * @brief Local helper that sets up a shader variant once it is linked. Every variant reads its uniforms from blocks
+ * in the stream ring, except for the sampler.
+ * 
+ * @param program   The variant's shader program
+ */
+static void setupDrawProgram(GLuint program) {
+  setUniformBlockBinding(program, "frame_block", FRAME_BLOCK_BINDING);
+  setUniformBlockBinding(program, "draw_block", DRAW_BLOCK_BINDING);
+  useProgram(program);
+  setUniformInt(program, "diffuse_map", 0);   // Sample from texture unit 0
+}
+
+/**
+ * @brief Local helper that fills in the draw block of a procedural mesh
+ * 
+ * @param block     The block to fill in
+ * @param mesh      The mesh drawn
+ */
+static void buildDrawBlock(draw_block_t *block, const mesh_t *mesh) {
+  memset(block, 0, sizeof(draw_block_t));
+  block->sphere_stacks = (GLint)mesh->stacks;
+  block->sphere_sectors = (GLint)mesh->sectors;
+}
+
+/**
+ * @brief Local helper that writes the frame block and the draw block of every procedural mesh draw into one range
+ * of the stream ring, and binds the frame block. Each block is built on the stack and copied into the mapped range
+ * whole so the (possibly write combined) mapping is never read. Everything else about a draw is in its shader
+ * variant.
+ * 
+ * @param alpha         How far between the last two steps the frame is
+ * @param draws         Draws whose block is written if they need one (their block is set to where it went)
+ * @param draw_count    The number of draws
+ */
+static void writeUniformBlocks(float alpha, draw_batch_t *draws, size_t draw_count) {
+  size_t block_count = 0;
+  for (size_t k = 0; k < draw_count; k++)
+    block_count += proceduralMesh(draws[k].mesh);
+
+  GLsizeiptr frame_stride = streamRingStride(&stream_ring, sizeof(frame_block_t));
+  GLsizeiptr draw_stride = streamRingStride(&stream_ring, sizeof(draw_block_t));
+  GLintptr offset;
+  unsigned char *data = (unsigned char *)mapStreamRing(&stream_ring,
+    frame_stride + draw_stride * (GLsizeiptr)block_count, &offset);
+
+  // The frame block, the sun is the first body
+  frame_block_t frame;
+  glm_mat4_copy(camera.view_projection_matrix, frame.view_projection);
+  glm_mat4_copy(camera.projection_matrix, frame.projection);
+  glm_vec4_zero(frame.sun_position);
+  if (bodies.count > 0)
+    glm_vec3_copy(bodies.render_position[0], frame.sun_position);
+  frame.time = (float)(scene_time - (1.0f - alpha) * scene_step);
+  frame.padding[0] = frame.padding[1] = frame.padding[2] = 0.0f;
+  memcpy(data, &frame, sizeof(frame_block_t));
+  bindBufferRange(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, stream_ring.buffer, offset, sizeof(frame_block_t));
+
+  // Then a draw block per procedural mesh draw
+  GLintptr next = frame_stride;
+  for (size_t k = 0; k < draw_count; k++) {
+    if (!proceduralMesh(draws[k].mesh))
+      continue;
+    draw_block_t block;
+    buildDrawBlock(&block, draws[k].mesh);
+    memcpy(data + next, &block, sizeof(draw_block_t));
+    draws[k].block = offset + next;
+    next += draw_stride;
+  }
+
+  unmapStreamRing(&stream_ring);
+}
+
+/**
+ * @brief Local helper that binds the draw block of a draw
+ * 
+ * @param block   Where the block is in the stream ring
+ */
+static void bindDrawBlock(GLintptr block) {
+  bindBufferRange(GL_UNIFORM_BUFFER, DRAW_BLOCK_BINDING, stream_ring.buffer, block, sizeof(draw_block_t));
+}
+
+/**
+ * @brief Local helper that works out whether a sphere can be drawn as an impostor. The quad faces the camera
+ * through the sphere's center, so it only works with the camera outside the sphere and the whole quad in front of
+ * the near plane.
+ * 
+ * @param position  The camera relative position of the sphere
+ * @param radius    The radius of the sphere
+ * @return true     If the impostor quad is fully in front of the near plane
+ * @return false    If the sphere has to be drawn with its mesh
+ */
+static bool impostorFits(const vec3 position, float radius) {
+  vec3 center; glm_mat4_mulv3(camera.view_matrix, (float *)position, 1.0f, center);
+  float distance2 = glm_vec3_norm2(center);
+  if (distance2 <= radius * radius)
+    return false;   // The camera is inside the sphere
+
+  // The quad's corners are at most half_size * sqrt(2 * (1 - w.z^2)) closer to the camera than the center along -z
+  float distance = sqrtf(distance2);
+  float half_size = radius * distance / sqrtf(distance2 - radius * radius);
+  float w_z = center[2] / distance;
+  float nearest = -center[2] - half_size * sqrtf(2.0f * (1.0f - w_z * w_z));
+
+  return nearest > camera.projection_fields.z_near;
+}
+
+/**
+ * @brief Local helper that builds the instance of a sphere impostor. The inverse of the sphere's rotation into view
+ * space takes hit normals back to the sphere's own space for its uvs.
+ * 
+ * @param position      The camera relative position of the sphere
+ * @param orientation   The orientation of the sphere
+ * @param radius        The radius of the sphere
+ * @param instance      Where to build the instance
+ */
+static void buildImpostorInstance(const vec3 position, const versor orientation, float radius, instance_t *instance) {
+  mat4 rotation; glm_quat_mat4((float *)orientation, rotation);
+  glm_mat4_mul(camera.view_matrix, rotation, instance->transform);
+
+  // Move the sphere into view space
+  vec3 center; glm_mat4_mulv3(camera.view_matrix, (float *)position, 1.0f, center);
+  glm_vec4(center, radius, instance->transform[3]);
+}
+
+/**
+ * @brief Local helper that checks whether two meshes draw the same geometry the same way. Bodies without levels of
+ * detail each keep their own copy of their mesh, so meshes are compared by what they draw rather than by address.
+ * 
+ * @param a   A mesh
+ * @param b   Another mesh
+ * @return true   If drawing either mesh draws the same thing
+ * @return false  If they differ
+ */
+static bool sameMesh(const mesh_t *a, const mesh_t *b) {
+  if (a == b)
+    return true;
+  if (!a || !b)
+    return false;   // Impostors only share batches with impostors
+  return a->vbo == b->vbo && a->ebo == b->ebo && a->base_vertex == b->base_vertex &&
+    a->element_offset == b->element_offset && a->draw_mode == b->draw_mode &&
+    a->vertex_count == b->vertex_count && a->element_count == b->element_count &&
+    a->vertex_format == b->vertex_format && a->stacks == b->stacks && a->sectors == b->sectors;
+}
+
+/**
+ * @brief Local helper that checks whether two meshes are drawn from the same buffers with the same vertex layout
+ * and primitive, so one multi draw indirect call can draw both
+ * 
+ * @param a   A mesh
+ * @param b   Another mesh
+ * @return true   If they share their draw state
+ * @return false  If they don't
+ */
+static bool sameMeshState(const mesh_t *a, const mesh_t *b) {
+  return a->vbo == b->vbo && a->ebo == b->ebo && a->vertex_format == b->vertex_format &&
+    a->index_type == b->index_type && a->draw_mode == b->draw_mode;
+}
+
+/**
+ * @brief Local helper that finds the render queue slot of a mesh's draw state, handing out a new one if no mesh
+ * with a slot shares it
+ * 
+ * @param mesh      The mesh
+ * @return GLuint   The draw state slot
+ */
+static GLuint findStateSlot(const mesh_t *mesh) {
+  for (size_t slot = 0; slot < queue_mesh_count; slot++) {
+    if (sameMeshState(&queue_meshes[slot], mesh))
+      return queue_mesh_states[slot];
+  }
+  return queue_state_count < MAX_QUEUE_STATES ? (GLuint)queue_state_count++ : MAX_QUEUE_STATES - 1;
+}
+
+/**
+ * @brief Local helper that finds the render queue slots of a mesh, or of every level of a mesh_lod_t, handing out
+ * new ones if they haven't been added before. The levels take consecutive slots, so level l is at the slot
+ * returned plus l.
+ * 
+ * @param meshes    The mesh or levels
+ * @param count     The number of meshes
+ * @return GLuint   The slot of the first mesh
+ */
+static GLuint findMeshSlot(const mesh_t *meshes, GLuint count) {
+  for (size_t slot = 0; slot + count <= queue_mesh_count; slot++) {
+    GLuint matched = 0;
+    while (matched < count && sameMesh(&queue_meshes[slot + matched], &meshes[matched]))
+      matched++;
+    if (matched == count)
+      return (GLuint)slot;
+  }
+
+  assert(queue_mesh_count + count <= MAX_QUEUE_MESHES);
+  for (GLuint level = 0; level < count; level++) {
+    queue_mesh_states[queue_mesh_count] = findStateSlot(&meshes[level]);
+    queue_meshes[queue_mesh_count++] = meshes[level];
+  }
+  return (GLuint)(queue_mesh_count - count);
+}
+
+/**
+ * @brief Local helper that finds the render queue slot of a texture, handing out a new one if it hasn't been
+ * added before
+ * 
+ * @param texture   The texture id
+ * @return GLuint   The texture slot
+ */
+static GLuint findTextureSlot(GLuint texture) {
+  for (size_t slot = 0; slot < queue_texture_count; slot++) {
+    if (queue_textures[slot] == texture)
+      return (GLuint)slot;
+  }
+
+  assert(queue_texture_count < MAX_QUEUE_TEXTURES);
+  queue_textures[queue_texture_count] = texture;
+  return (GLuint)queue_texture_count++;
+}
+
+/**
+ * @brief Local helper that gets the mesh a body is drawn with this frame
+ * 
+ * @param i                 The index of the body
+ * @return const mesh_t*    Its level of detail, or its mesh if it doesn't have levels of detail
+ */
+static const mesh_t *bodyMesh(size_t i) {
+  const renderable_t *renderable = &bodies.renderable[i];
+  return renderable->lods ? &renderable->lods->levels[bodies.lod[i]] : &renderable->mesh;
+}
+
+/**
+ * @brief Local helper that builds the render queue key of a body (see DRAW_KEY_PASS_SHIFT)
+ * 
+ * @param i           The index of the body
+ * @param pass        The pass it is drawn in
+ * @param mesh_slot   The slot of the mesh it is drawn with (0 for impostors)
+ * @return uint64_t   The key
+ */
+static uint64_t buildDrawKey(size_t i, GLuint pass, GLuint mesh_slot) {
+  float distance2 = glm_vec3_norm2(bodies.render_position[i]);
+  uint32_t depth; memcpy(&depth, &distance2, sizeof(depth));
+  GLuint state = pass == DRAW_PASS_IMPOSTOR ? 0 : queue_mesh_states[mesh_slot];
+
+  return (uint64_t)pass << DRAW_KEY_PASS_SHIFT | (uint64_t)bodies.texture_slot[i] << DRAW_KEY_TEXTURE_SHIFT |
+    (uint64_t)state << DRAW_KEY_STATE_SHIFT | (uint64_t)mesh_slot << DRAW_KEY_MESH_SHIFT |
+    (uint64_t)(depth >> 16) << DRAW_KEY_DEPTH_SHIFT | (uint64_t)i;
+}
+
+/**
+ * @brief Local helper that draws instances of a mesh from the instance buffer with one instanced draw call
+ * 
+ * @param mesh      The mesh to draw
+ * @param texture   The texture to draw with
+ * @param block     Where the draw's draw_block_t is in the stream ring
+ * @param first     The first instance to draw
+ * @param count     The number of instances to draw
+ */
+static void drawMeshInstances(const mesh_t *mesh, GLuint texture, GLintptr block, GLuint first, GLuint count) {
+  // Bind the vbo and ebo of the mesh and point the instance attributes at its instances
+  bindMesh(mesh);
+  setInstanceAttributes(stream_ring.buffer, first);
+
+  // Pick the shader variant for the vertex format and texture, procedural meshes also need their draw block
+  useSceneVariant(mesh, texture);
+  if (proceduralMesh(mesh))
+    bindDrawBlock(block);
+  bindTexture(texture);
+
+  // Draw the buffers using the appropriate draw mode and number of elements to draw
+  if (mesh->ebo)
+    glDrawElementsInstancedBaseVertex(mesh->draw_mode, mesh->element_count, mesh->index_type,
+      (const GLvoid *)mesh->element_offset, count, mesh->base_vertex);
+  else
+    glDrawArraysInstanced(mesh->draw_mode, mesh->base_vertex, mesh->vertex_count, count);
+}
+
+/**
+ * @brief Local helper that checks whether two batches of indexed meshes can be drawn by the same multi draw
+ * indirect call, which needs the same texture, buffers, vertex layout, and primitive
+ * 
+ * @param a   A batch
+ * @param b   Another batch
+ * @return true   If they can be drawn together
+ * @return false  If they need separate calls
+ */
+static bool sameDrawState(const draw_batch_t *a, const draw_batch_t *b) {
+  return a->texture == b->texture && sameMeshState(a->mesh, b->mesh);   // So the shader variant is the same too
+}
+
+/**
+ * @brief Local helper that draws the batches of indexed meshes from one array of indirect commands, built on the
+ * CPU with one command per batch. Each run of batches that share their draw state takes one
+ * glMultiDrawElementsIndirect call.
+ * 
+ * @return size_t   The number of batches drawn (the indexed meshes lead the render queue)
+ */
+static size_t drawMeshBatchesIndirect(void) {
+  size_t command_count = 0;
+  while (command_count < batch_count && batches[command_count].mesh && batches[command_count].mesh->ebo)
+    command_count++;  // Only procedural meshes and impostors are left after them
+  if (command_count == 0)
+    return 0;
+
+  // Write one command per batch into the stream ring, the base instance takes the place of pointing the instance
+  // attributes at the batch
+  GLintptr offset;
+  draw_elements_indirect_command_t *commands = (draw_elements_indirect_command_t *)mapStreamRing(&stream_ring,
+    sizeof(draw_elements_indirect_command_t) * command_count, &offset);
+  for (size_t k = 0; k < command_count; k++) {
+    const draw_batch_t *batch = &batches[k];
+    const mesh_t *mesh = batch->mesh;
+    GLintptr index_size = mesh->index_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+    commands[k] = (draw_elements_indirect_command_t){
+      (GLuint)mesh->element_count, batch->count, (GLuint)(mesh->element_offset / index_size), mesh->base_vertex, batch->first
+    };
+  }
+  unmapStreamRing(&stream_ring);
+  bindBuffer(GL_DRAW_INDIRECT_BUFFER, stream_ring.buffer);
+
+  // Draw every run of batches that share a texture and vertex layout with one call
+  for (size_t start = 0, end; start < command_count; start = end) {
+    const draw_batch_t *batch = &batches[start];
+    for (end = start + 1; end < command_count && sameDrawState(batch, &batches[end]); end++);
+
+    bindMesh(batch->mesh);
+    setInstanceAttributes(stream_ring.buffer, 0);
+    useSceneVariant(batch->mesh, batch->texture);
+    bindTexture(batch->texture);
+    glMultiDrawElementsIndirect(batch->mesh->draw_mode, batch->mesh->index_type,
+      (const GLvoid *)(offset + start * sizeof(draw_elements_indirect_command_t)), (GLsizei)(end - start), 0);
+  }
+
+  return command_count;
+}
+
+/**
+ * @brief Local helper that checks whether a body is culled and given its level of detail by the culling compute shader
+ * 
+ * @param i   The index of the body
+ * @return true   If the compute shader handles the body
+ * @return false  If it goes through the CPU batches
+ */
+static bool culledOnGPU(size_t i) {
+  return gpu_culling && bodies.renderable[i].lods == &sphere_lods;
+}
+
+/**
+ * @brief Local helper that finds the cull group of a texture this frame, adding it if there isn't one yet
+ * 
+ * @param texture   The texture of a body culled on the GPU
+ * @return GLuint   The index of the group
+ */
+static GLuint findCullGroup(GLuint texture) {
+  for (size_t g = 0; g < cull_group_count; g++) {
+    if (cull_groups[g].texture == texture)
+      return (GLuint)g;
+  }
+
+  assert(cull_group_count < MAX_SCENE_BODIES);
+  cull_groups[cull_group_count] = (draw_batch_t){NULL, texture, 0, 0, 0};
+  return (GLuint)cull_group_count++;
+}
+
+/**
+ * @brief Local helper that hands every default sphere body to the culling compute shader, which tests them against the
+ * frustum and the occluders itself. The CPU only lays out where each cull group's instances go, one list per level of
+ * detail plus one for impostors each as long as the group, and resets the instance counts. The compute shader appends
+ * the bodies that survive to the lists.
+ * 
+ * @param focal_length    Pixels per unit of tan space
+ * @param occluders       The occluding spheres (center in xyz, radius in w)
+ * @param occluder_count  The number of occluders (MAX_OCCLUDERS at most)
+ */
+static void dispatchCulling(float focal_length, const vec4 *occluders, size_t occluder_count) {
+  size_t candidate_count = 0;
+  for (size_t i = 0; i < bodies.count; i++)
+    candidate_count += culledOnGPU(i);
+  cull_group_count = 0;
+  if (candidate_count == 0)
+    return;
+
+  // Write the candidates straight into the stream ring and count the bodies of each texture. Each is built on the
+  // stack and copied whole so the ring is never read.
+  GLintptr candidate_offset;
+  GLsizeiptr candidate_size = sizeof(cull_candidate_t) * candidate_count;
+  cull_candidate_t *candidates = (cull_candidate_t *)mapStreamRing(&stream_ring, candidate_size, &candidate_offset);
+  size_t c = 0;
+  for (size_t i = 0; i < bodies.count; i++) {
+    if (!culledOnGPU(i))
+      continue;
+    cull_candidate_t candidate;
+    memcpy(candidate.model_matrix, bodies.model_matrix[i], sizeof(candidate.model_matrix));
+    candidate.radius = bodies.bounds.radius[i];
+    candidate.body = (GLuint)i;
+    candidate.group = findCullGroup(bodies.renderable[i].texture.id);
+    cull_groups[candidate.group].count++;
+    memcpy(&candidates[c++], &candidate, sizeof(cull_candidate_t));
+  }
+  unmapStreamRing(&stream_ring);
+
+  // Give every group a list per level of detail and one for impostors, all starting out empty. The mesh commands and
+  // the impostor commands share a range, each starting aligned so it can be bound on its own.
+  GLuint lod_count = sphere_lods.count;
+  GLsizeiptr command_size = sizeof(draw_elements_indirect_command_t) * cull_group_count * lod_count;
+  GLsizeiptr command_stride = streamRingStride(&stream_ring, command_size);
+  GLsizeiptr impostor_size = sizeof(draw_arrays_indirect_command_t) * cull_group_count;
+  unsigned char *commands = (unsigned char *)mapStreamRing(&stream_ring, command_stride + impostor_size,
+    &cull_command_offset);
+  cull_impostor_offset = cull_command_offset + command_stride;
+  GLuint first = 0;
+  for (size_t g = 0; g < cull_group_count; g++) {
+    GLuint count = cull_groups[g].count;
+    for (GLuint lod = 0; lod < lod_count; lod++) {
+      const mesh_t *mesh = &sphere_lods.levels[lod];
+      GLintptr index_size = mesh->index_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+      draw_elements_indirect_command_t command = {
+        (GLuint)mesh->element_count, 0, (GLuint)(mesh->element_offset / index_size), mesh->base_vertex, first + lod * count
+      };
+      memcpy(commands + sizeof(command) * (g * lod_count + lod), &command, sizeof(command));
+    }
+    draw_arrays_indirect_command_t impostor_command = {4, 0, 0, first + lod_count * count};
+    memcpy(commands + command_stride + sizeof(impostor_command) * g, &impostor_command, sizeof(impostor_command));
+    first += (lod_count + 1) * count;
+  }
+  unmapStreamRing(&stream_ring);
+
+  // Only the compute shader writes the instances, so last frame's are orphaned rather than streamed
+  bindBuffer(GL_SHADER_STORAGE_BUFFER, culled_instance_buffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(instance_t) * first, NULL, GL_STREAM_DRAW);
+
+  bindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, stream_ring.buffer, candidate_offset, candidate_size);
+  bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, lod_state_buffer);
+  bindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, stream_ring.buffer, cull_command_offset, command_size);
+  bindBufferRange(GL_SHADER_STORAGE_BUFFER, 3, stream_ring.buffer, cull_impostor_offset, impostor_size);
+  bindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, culled_instance_buffer);
+
+  // Send the frustum, occluders, levels of detail, and impostor test to the compute shader
+  vec4 planes[6]; glm_frustum_planes(camera.view_projection_matrix, planes);
+  float position_scale[MAX_MESH_LODS];
+  for (GLuint lod = 0; lod < lod_count; lod++)
+    position_scale[lod] = sphere_lods.levels[lod].position_scale;
+
+  useProgram(cull_program);
+  setUniformUint(cull_program, "candidate_count", (GLuint)candidate_count);
+  setUniformUint(cull_program, "lod_count", lod_count);
+  setUniformVec4Array(cull_program, "planes", (const vec4 *)planes, 6);
+  setUniformUint(cull_program, "occluder_count", (GLuint)occluder_count);
+  if (occluder_count > 0)
+    setUniformVec4Array(cull_program, "occluders", occluders, (GLsizei)occluder_count);
+  setUniformFloat(cull_program, "focal_length", focal_length);
+  setUniformFloatArray(cull_program, "max_radius", sphere_lods.max_radius, (GLsizei)lod_count);
+  setUniformFloatArray(cull_program, "position_scale", position_scale, (GLsizei)lod_count);
+  setUniformFloat(cull_program, "lod_hysteresis", DEFAULT_LOD_HYSTERESIS);
+  setUniformMat4(cull_program, "view", camera.view_matrix);
+  setUniformFloat(cull_program, "z_near", camera.projection_fields.z_near);
+  setUniformInt(cull_program, "use_impostors", USE_SPHERE_IMPOSTORS);
+
+  // One invocation per candidate, then make the counts and instances visible to the draws
+  glDispatchCompute((GLuint)(candidate_count + CULL_WORK_GROUP_SIZE - 1) / CULL_WORK_GROUP_SIZE, 1, 1);
+  glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
+
+/**
+ * @brief Local helper that draws the meshes of the bodies that survived GPU culling, one multi draw indirect call
+ * per cull group covering all of its levels of detail
+ * 
+ */
+static void drawCulledMeshes(void) {
+  if (cull_group_count == 0)
+    return;
+
+  // Every level shares the geometry buffer and vertex layout (checked in initScene)
+  const mesh_t *mesh = &sphere_lods.levels[0];
+  bindMesh(mesh);
+  setInstanceAttributes(culled_instance_buffer, 0);
+
+  bindBuffer(GL_DRAW_INDIRECT_BUFFER, stream_ring.buffer);
+  for (size_t g = 0; g < cull_group_count; g++) {
+    useSceneVariant(mesh, cull_groups[g].texture);
+    bindTexture(cull_groups[g].texture);
+    GLintptr offset = cull_command_offset + g * sphere_lods.count * sizeof(draw_elements_indirect_command_t);
+    glMultiDrawElementsIndirect(mesh->draw_mode, mesh->index_type, (const GLvoid *)offset,
+      (GLsizei)sphere_lods.count, 0);
+  }
+}
+
+/**
+ * @brief Local helper that ray traces the impostors of the bodies that survived GPU culling, one indirect draw per
+ * cull group. procedural_vao must already be bound.
+ * 
+ */
+static void drawCulledImpostors(void) {
+  if (cull_group_count == 0)
+    return;
+
+  setInstanceAttributes(culled_instance_buffer, 0);
+  bindBuffer(GL_DRAW_INDIRECT_BUFFER, stream_ring.buffer);
+  for (size_t g = 0; g < cull_group_count; g++) {
+    useImpostorVariant(cull_groups[g].texture);
+    bindTexture(cull_groups[g].texture);
+    glDrawArraysIndirect(GL_TRIANGLE_STRIP,
+      (const GLvoid *)(cull_impostor_offset + g * sizeof(draw_arrays_indirect_command_t)));
+  }
+}
+
+/**
+ * @brief Local helper that checks whether every level of detail can be drawn by one multi draw indirect call
+ * 
+ * @param lods  The levels of detail
+ * @return true   If they are all indexed and share their buffers and vertex layout
+ * @return false  If they differ
+ */
+static bool lodsShareDrawState(const mesh_lod_t *lods) {
+  for (GLuint lod = 0; lod < lods->count; lod++) {
+    const mesh_t *mesh = &lods->levels[lod], *first = &lods->levels[0];
+    if (!mesh->ebo || mesh->vbo != first->vbo || mesh->ebo != first->ebo || mesh->draw_mode != first->draw_mode ||
+      mesh->vertex_format != first->vertex_format || mesh->index_type != first->index_type)
+      return false;
+  }
+  return lods->count > 0;
+}
+
+/**
+ * @brief Local helper that picks the bodies big enough on screen to occlude the rest with, largest first. Only bodies
+ * drawn with the default sphere are used, as their inscribed sphere (the smallest scale) is always covered. They are
+ * taken from every body rather than the visible ones, since those are culled on the GPU when it culls at all (an
+ * occluder out of view hides nothing in view, so it only takes up a slot).
+ * 
+ * @param focal_length  Pixels per unit of tan space
+ * @param occluders     Where to write the occluders (MAX_OCCLUDERS entries)
+ * @return size_t       The number of occluders
+ */
+static size_t selectOccluders(float focal_length, vec4 *occluders) {
+  float pixels[MAX_OCCLUDERS];    // The radius on screen of each occluder
+  size_t count = 0;
+
+  for (size_t i = 0; i < bodies.count; i++) {
+    if (bodies.renderable[i].lods != &sphere_lods)
+      continue;
+    // A non-uniformly scaled sphere is an ellipsoid, which only covers its inscribed sphere. The camera can be inside
+    // the ellipsoid while outside that sphere though, where the body is culled away, so test against its bounds.
+    float radius = glm_vec3_min(bodies.frame_scale[i]), bound = bodies.bounds.radius[i];
+    float distance2 = glm_vec3_norm2(bodies.render_position[i]);
+    if (distance2 <= bound * bound)
+      continue;   // The camera is inside (or right at) the body
+    float screen_radius = focal_length * radius / sqrtf(distance2 - radius * radius);
+    if (screen_radius < MIN_OCCLUDER_PIXELS || (count == MAX_OCCLUDERS && screen_radius <= pixels[count - 1]))
+      continue;
+
+    // Insert it in order of size, dropping the smallest when full. A pixel at the silhouette is about
+    // radius / screen_radius across.
+    size_t slot = count < MAX_OCCLUDERS ? count++ : count - 1;
+    for (; slot > 0 && pixels[slot - 1] < screen_radius; slot--) {
+      pixels[slot] = pixels[slot - 1];
+      glm_vec4_copy(occluders[slot - 1], occluders[slot]);
+    }
+    pixels[slot] = screen_radius;
+    glm_vec4(bodies.render_position[i], radius * (1.0f - OCCLUDER_PIXEL_MARGIN / screen_radius), occluders[slot]);
+  }
+
+  return count;
+}
+
 // PHYSICS OBJECT FUNCTIONS //
 
 phys_object_t buildPhysicsObject(
@@ -55,32 +852,148 @@ phys_object_t buildPhysicsObject(
   return object;    // Return the object
 }
 
+size_t addPhysicsObject(const phys_object_t *object) {
+  assert(object && bodies.count < MAX_SCENE_BODIES);
+
+  size_t i = bodies.count++;  // Take the next free slot
+
+  // Start at rest so the first frame doesn't interpolate from the origin
+  bodies.position.x[i] = bodies.prev_position.x[i] = object->position.x;
+  bodies.position.y[i] = bodies.prev_position.y[i] = object->position.y;
+  bodies.position.z[i] = bodies.prev_position.z[i] = object->position.z;
+  bodies.orientation[i] = object->renderable.model_fields.orientation;
+  bodies.scale[i] = object->renderable.model_fields.scale;
+  bodies.renderable[i] = object->renderable;
+  bodies.lod[i] = MAX_MESH_LODS;  // Not drawn yet
+  bodies.screen_radius[i] = 0.0f;
+  bodies.impostor[i] = false;
+
+  // Bodies drawn with the default sphere get its levels of detail
+  if (!bodies.renderable[i].lods && sameMesh(&bodies.renderable[i].mesh, &default_sphere))
+    bodies.renderable[i].lods = &sphere_lods;
+
+  // Give its mesh (or levels) and texture their render queue slots
+  const mesh_lod_t *lods = bodies.renderable[i].lods;
+  bodies.mesh_slot[i] = lods ? findMeshSlot(lods->levels, lods->count) : findMeshSlot(&bodies.renderable[i].mesh, 1);
+  bodies.texture_slot[i] = findTextureSlot(bodies.renderable[i].texture.id);
+
+  return i;
+}
+
 // SCENE FUNCTIONS //
 
 void initScene(void) {
+  // Allocate the body table
+  bodies.count = 0;
+  bodies.position = allocHighPVectorArray(MAX_SCENE_BODIES);
+  bodies.prev_position = allocHighPVectorArray(MAX_SCENE_BODIES);
+  bodies.frame_position = allocHighPVectorArray(MAX_SCENE_BODIES);
+  bodies.orientation = (interpol_quat_t *)aligned_alloc(16, sizeof(interpol_quat_t) * MAX_SCENE_BODIES);
+  bodies.scale = (interpol_t *)malloc(sizeof(interpol_t) * MAX_SCENE_BODIES);
+  bodies.render_position = (vec3 *)malloc(sizeof(vec3) * MAX_SCENE_BODIES);
+  bodies.frame_orientation = (versor *)aligned_alloc(16, sizeof(versor) * MAX_SCENE_BODIES);
+  bodies.frame_scale = (vec3 *)malloc(sizeof(vec3) * MAX_SCENE_BODIES);
+  bodies.model_matrix = (mat4 *)aligned_alloc(32, sizeof(mat4) * MAX_SCENE_BODIES);
+  bodies.bounds = allocBoundingSphereArray(MAX_SCENE_BODIES);
+  bodies.cpu_bounds = allocBoundingSphereArray(MAX_SCENE_BODIES);
+  bodies.cpu_body = (uint32_t *)malloc(sizeof(uint32_t) * MAX_SCENE_BODIES);
+  bodies.visible = (uint32_t *)malloc(sizeof(uint32_t) * MAX_SCENE_BODIES);
+  bodies.visible_count = 0;
+  bodies.screen_radius = (float *)malloc(sizeof(float) * MAX_SCENE_BODIES);
+  bodies.lod = (GLuint *)malloc(sizeof(GLuint) * MAX_SCENE_BODIES);
+  bodies.impostor = (bool *)malloc(sizeof(bool) * MAX_SCENE_BODIES);
+  bodies.mesh_slot = (GLuint *)malloc(sizeof(GLuint) * MAX_SCENE_BODIES);
+  bodies.texture_slot = (GLuint *)malloc(sizeof(GLuint) * MAX_SCENE_BODIES);
+  bodies.renderable = (renderable_t *)malloc(sizeof(renderable_t) * MAX_SCENE_BODIES);
+  assert(bodies.position.x && bodies.prev_position.x && bodies.frame_position.x);
+  assert(bodies.orientation && bodies.scale);
+  assert(bodies.render_position && bodies.frame_orientation && bodies.frame_scale && bodies.model_matrix);
+  assert(bodies.bounds.x && bodies.cpu_bounds.x && bodies.cpu_body && bodies.visible);
+  assert(bodies.screen_radius && bodies.lod && bodies.impostor && bodies.renderable);
+  assert(bodies.mesh_slot && bodies.texture_slot);
+
+  // Allocate room for one instance and one draw batch per body
+  batches = (draw_batch_t *)malloc(sizeof(draw_batch_t) * MAX_SCENE_BODIES);
+  assert(batches);
+
+  // And for the render queue
+  draw_keys = (uint64_t *)malloc(sizeof(uint64_t) * MAX_SCENE_BODIES);
+  draw_key_scratch = (uint64_t *)malloc(sizeof(uint64_t) * MAX_SCENE_BODIES);
+  queue_meshes = (mesh_t *)malloc(sizeof(mesh_t) * MAX_QUEUE_MESHES);
+  queue_mesh_states = (GLuint *)malloc(sizeof(GLuint) * MAX_QUEUE_MESHES);
+  queue_textures = (GLuint *)malloc(sizeof(GLuint) * MAX_QUEUE_TEXTURES);
+  queue_mesh_count = queue_state_count = queue_texture_count = 0;
+  assert(draw_keys && draw_key_scratch && queue_meshes && queue_mesh_states && queue_textures);
+
+  // And for the bodies culled on the GPU
+  cull_groups = (draw_batch_t *)malloc(sizeof(draw_batch_t) * MAX_SCENE_BODIES);
+  assert(cull_groups);
+
   glGenVertexArrays(1, &vao); // Generate a vertex array object
+  glGenVertexArrays(1, &procedural_vao);  // And one without vertex attributes for procedural meshes
+  stream_ring = createStreamRing(STREAM_RING_FRAME_BYTES, sizeof(instance_t));  // And a ring for per frame data
+
+  // Multi draw indirect needs the base instance of each command to find its batch's instances
+  multi_draw_indirect = USE_MULTI_DRAW_INDIRECT && GLAD_GL_ARB_multi_draw_indirect && GLAD_GL_ARB_base_instance;
+
+  // Both vaos read the instance attributes
+  bindVertexArray(procedural_vao);
+  enableInstanceAttributes();
+  setInstanceAttributes(stream_ring.buffer, 0);
 
   // Build meshes and format them with the vao
-  glBindVertexArray(vao);   // Bind the vao state
+  bindVertexArray(vao);   // Bind the vao state
 
-  default_sphere = buildSphereMesh(1.0f, 100, 100);   // Build a sphere of radius 1
+  // Static meshes are suballocated from one vbo and ebo
+  initGeometryBuffer(GEOMETRY_BUFFER_VERTEX_BYTES, GEOMETRY_BUFFER_ELEMENT_BYTES);
+
+  // Build the levels of detail for spheres of radius 1
+  if (USE_PROCEDURAL_SPHERES)
+    sphere_lods = buildProceduralSphereLODs(DEFAULT_PROCEDURAL_SPHERE_STACKS, DEFAULT_SPHERE_LODS, DEFAULT_LOD_PIXEL_ERROR);
+  else
+    sphere_lods = buildIcosphereLODs(1.0f, DEFAULT_SPHERE_SUBDIVISIONS, DEFAULT_SPHERE_LODS, DEFAULT_LOD_PIXEL_ERROR);
+  default_sphere = sphere_lods.levels[0];
 
   // Format the mesh with the vbo
   // Setup vertex attributes
-  glBindBuffer(GL_ARRAY_BUFFER, default_sphere.vbo);
-  // Position
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (GLvoid *)0);
-  glEnableVertexAttribArray(0);
-  // Normal
-  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (GLvoid *)offsetof(vertex_t, normal));
-  glEnableVertexAttribArray(1);
-  // Uv
-  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (GLvoid *)offsetof(vertex_t, uv));
-  glEnableVertexAttribArray(2);
+  glEnableVertexAttribArray(0);   // Position
+  glEnableVertexAttribArray(1);   // Normal
+  glEnableVertexAttribArray(2);   // Uv
+  enableInstanceAttributes();     // Model matrix
+  setInstanceAttributes(stream_ring.buffer, 0);
+  bindMesh(&default_sphere);
+  bindVertexArray(vao);
+
 
+  // Start compiling every variant of the shader programs at once, the driver works on them while the rest of the
+  // scene is set up and the first frames are drawn. Until a variant is done its fallback, which only keeps the
+  // vertex format features, draws in its place (untextured).
+  scene_variants = buildShaderVariants(SCENE_VERTEX_SHADER_DIR, SCENE_FRAGMENT_SHADER_DIR, scene_features,
+    sizeof(scene_features) / sizeof(scene_features[0]),
+    SCENE_FEATURE_OCTAHEDRAL_NORMALS | SCENE_FEATURE_PROCEDURAL_SPHERE, setupDrawProgram);
+  impostor_variants = buildShaderVariants(IMPOSTOR_VERTEX_SHADER_DIR, IMPOSTOR_FRAGMENT_SHADER_DIR, impostor_features,
+    sizeof(impostor_features) / sizeof(impostor_features[0]), 0, setupDrawProgram);
+  compileShaderVariants(&scene_variants);
+  compileShaderVariants(&impostor_variants);
 
-  // Compile and link shader program
-  program = compileAndLinkShaderProgram(SCENE_VERTEX_SHADER_DIR, SCENE_FRAGMENT_SHADER_DIR);
+  // Cull the default sphere bodies on the GPU where there are compute shaders and every level of detail fits in
+  // one multi draw indirect call
+  gpu_culling = USE_GPU_CULLING && multi_draw_indirect && GLAD_GL_ARB_draw_indirect && GLAD_GL_ARB_compute_shader &&
+    GLAD_GL_ARB_shader_storage_buffer_object && GLAD_GL_ARB_shader_image_load_store && lodsShareDrawState(&sphere_lods);
+  if (gpu_culling) {
+    cull_program = compileAndLinkComputeProgram(CULL_COMPUTE_SHADER_DIR);
+    glGenBuffers(1, &lod_state_buffer);
+    glGenBuffers(1, &culled_instance_buffer);
+
+    // Every body starts out without a level of detail, like bodies.lod
+    GLuint *lod_states = (GLuint *)malloc(sizeof(GLuint) * MAX_SCENE_BODIES);
+    assert(lod_states);
+    for (size_t i = 0; i < MAX_SCENE_BODIES; i++)
+      lod_states[i] = MAX_MESH_LODS;
+    bindBuffer(GL_SHADER_STORAGE_BUFFER, lod_state_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * MAX_SCENE_BODIES, lod_states, GL_DYNAMIC_DRAW);
+    free(lod_states);
+  }
 
   // Setup the camera
   camera = buildCamera(
@@ -93,11 +1006,27 @@ void initScene(void) {
     (vec3){0.0f, 1.0f, 0.0f}    // Up vector (shouldn't ever change)
   );
 
+  // Start the camera at the center of the solar system
+  camera_position = (highp_vec3){0.0, 0.0, 0.0};
+
   // Build physics objects
-  
+  addPhysicsObject(&sol);
 }
 
 void updateScene(float dt) {
+  // Keep the last state around so drawScene can interpolate between steps
+  memcpy(bodies.prev_position.x, bodies.position.x, sizeof(double) * bodies.count);
+  memcpy(bodies.prev_position.y, bodies.position.y, sizeof(double) * bodies.count);
+  memcpy(bodies.prev_position.z, bodies.position.z, sizeof(double) * bodies.count);
+  for (size_t i = 0; i < bodies.count; i++) {
+    glm_quat_copy(bodies.orientation[i].curr, bodies.orientation[i].prev);
+    glm_vec3_copy(bodies.scale[i].curr, bodies.scale[i].prev);
+  }
+
+  // Keep time with the steps so frames can interpolate it like the bodies
+  scene_time += dt;
+  scene_step = dt;
+
   /**
    * @brief TODO: 
    * 
@@ -106,48 +1035,30 @@ void updateScene(float dt) {
 
 void drawRenderable(renderable_t renderable, float alpha) {
   /**
-   * @brief This method of drawing is pretty inefficient and will cause problems as the number
-   * of drawcalls gets large. To rectify the issue, later on we should refactor the code to allow
-   * for instancing
+   * @brief This draws a single renderable as a batch of one. Bodies in the scene are drawn by drawScene, which
+   * gathers them into one instanced draw per mesh and texture instead.
    */
 
-  // Bind the vbo and ebo of the renderable
-  glBindBuffer(GL_ARRAY_BUFFER, renderable.mesh.vbo);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, renderable.mesh.ebo);
-
   // Compute interpolated vectors
   vec3 position_int; interpolate(renderable.model_fields.position, alpha, position_int);
-  vec3 rotation_int; interpolate(renderable.model_fields.rotation, alpha, rotation_int);
+  versor orientation_int; interpolateOrientations(&renderable.model_fields.orientation, alpha, &orientation_int, 1);
   vec3 scale_int; interpolate(renderable.model_fields.scale, alpha, scale_int);
 
   // Build the model matrix using interpolated states
-  buildModelMatrix(position_int, (vec3){0.0f, 0.0f, 0.0f}, rotation_int, scale_int, renderable.model_matrix);
-
-  // Build the MVP matrix using the model matrix and camera view and projection matrices
-  mat4 MVP; glm_mat4_mul(camera.view_projection_matrix, renderable.model_matrix, MVP);
-
-  // Send the MVP matrix to the shader
-  setUniformMat4(program, "MVP", MVP);
+  buildModelMatrices((const vec3 *)position_int, (const versor *)orientation_int, (const vec3 *)scale_int, NULL,
+    (mat4 *)renderable.model_matrix, 1);
 
-  // Check if we need to bind a texture
-  if (renderable.texture.id) {
-    // Set the active texture
-    glActiveTexture(GL_TEXTURE0);   // Attach to texture unit 0
-
-    // Bind texture
-    glBindTexture(GL_TEXTURE_2D, renderable.texture.id);  // Bind the texture
-    setUniformInt(program, "diffuse_map", renderable.texture.id);
-
-    // Set texture flag to true
-    setUniformInt(program, "use_texture", true);
-  }
-  else {
-    // Set texture flag to false
-    setUniformInt(program, "use_texture", false);
-  }
-
-  // Draw the buffers using the appropriate draw mode and number of elements to draw
-  glDrawElements(renderable.mesh.draw_mode, renderable.mesh.element_count, GL_UNSIGNED_INT, (const GLvoid *)0);
+  // Write it as the only instance of a frame of its own and draw it
+  beginStreamRingFrame(&stream_ring);
+  instance_t instance; glm_mat4_copy(renderable.model_matrix, instance.transform);
+  if (renderable.mesh.position_scale != 1.0f)
+    glm_scale_uni(instance.transform, renderable.mesh.position_scale);  // Undo the normalization of packed positions
+  draw_batch_t draw = {&renderable.mesh, renderable.texture.id, 0, 1, 0};
+  memcpy(mapInstances(1, &draw.first), &instance, sizeof(instance_t));
+  unmapStreamRing(&stream_ring);
+  writeUniformBlocks(alpha, &draw, 1);
+  drawMeshInstances(&renderable.mesh, renderable.texture.id, draw.block, draw.first, 1);
+  endStreamRingFrame(&stream_ring);
 }
 
 void drawScene(float alpha) {
@@ -160,21 +1071,205 @@ void drawScene(float alpha) {
   glClearColor(0.0f, 0.0f, 0.0f, 1.0f);   // Set the clear color to black
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // Clear the color buffer and depth buffer
 
-  glBindVertexArray(vao); // Bind the vao for drawing
-  glUseProgram(program);  // Use the shader program
+  resetGLStateCounters();  // Count this frame's state changes from zero
+
+  // Pick up the shader variants that finished compiling since the last frame
+  updateShaderVariants(&scene_variants);
+  updateShaderVariants(&impostor_variants);
+
+  bindVertexArray(vao); // Bind the vao for drawing (each draw picks its own shader variant)
+
+  // Interpolate the body positions in high precision, then move them into camera relative rendering coordinates in
+  // one pass. Doing the subtraction before narrowing to float keeps nearby bodies steady far away from the sun.
+  lerpHighPVectorArrays(&bodies.prev_position, &bodies.position, alpha, &bodies.frame_position, bodies.count);
+  convertHighPVectorArrayRelative(
+    &bodies.frame_position, &camera_position, bodies.render_position, DEFAULT_HIGHP_TO_VEC3_SCALE_FACTOR, bodies.count);
+
+  // Interpolate the orientation and scale of every body in one pass each
+  interpolateOrientations(bodies.orientation, alpha, bodies.frame_orientation, bodies.count);
+  interpolateStates(bodies.scale, alpha, bodies.frame_scale, bodies.count);
+
+  // Build every model matrix in one batch
+  buildModelMatrices((const vec3 *)bodies.render_position, (const versor *)bodies.frame_orientation,
+    (const vec3 *)bodies.frame_scale, NULL, bodies.model_matrix, bodies.count);
+
+  // Work out the bounding sphere of every body
+  for (size_t i = 0; i < bodies.count; i++) {
+    bodies.bounds.x[i] = bodies.render_position[i][0];
+    bodies.bounds.y[i] = bodies.render_position[i][1];
+    bodies.bounds.z[i] = bodies.render_position[i][2];
+    bodies.bounds.radius[i] = glm_vec3_max(bodies.frame_scale[i]);
+  }
+
+  // Cull the bodies the compute shader doesn't against the view frustum in one batch. With GPU culling their spheres
+  // are packed together first, so the CPU never tests a body the compute shader does. Only the bodies left in the
+  // visible list are looked at from here on.
+  vec4 planes[6]; glm_frustum_planes(camera.view_projection_matrix, planes);
+  if (gpu_culling) {
+    size_t cpu_count = 0;
+    for (size_t i = 0; i < bodies.count; i++) {
+      if (culledOnGPU(i))
+        continue;
+      bodies.cpu_bounds.x[cpu_count] = bodies.bounds.x[i];
+      bodies.cpu_bounds.y[cpu_count] = bodies.bounds.y[i];
+      bodies.cpu_bounds.z[cpu_count] = bodies.bounds.z[i];
+      bodies.cpu_bounds.radius[cpu_count] = bodies.bounds.radius[i];
+      bodies.cpu_body[cpu_count++] = (uint32_t)i;
+    }
+    bodies.visible_count = cullBoundingSpheres((const vec4 *)planes, &bodies.cpu_bounds, bodies.visible, cpu_count);
+    for (size_t v = 0; v < bodies.visible_count; v++)
+      bodies.visible[v] = bodies.cpu_body[bodies.visible[v]];   // Still in increasing order
+  }
+  else
+    bodies.visible_count = cullBoundingSpheres((const vec4 *)planes, &bodies.bounds, bodies.visible, bodies.count);
 
-  // Draw the camera
+  // Then drop the ones hidden behind the biggest spheres on screen (the compute shader does the same for its bodies)
+  float focal_length = 0.5f * framebuffer_height / tanf(0.5f * camera.projection_fields.fov);
+  vec4 occluders[MAX_OCCLUDERS];
+  size_t occluder_count = USE_OCCLUSION_CULLING ? selectOccluders(focal_length, occluders) : 0;
+  bodies.visible_count = cullOccludedSpheres(
+    &bodies.bounds, (const vec4 *)occluders, occluder_count, bodies.visible, bodies.visible_count);
 
+  // Work out how big each body is on screen (a sphere of radius r at distance d spans r / sqrt(d^2 - r^2) in tan
+  // space) and pick the level of detail to draw it with
+  for (size_t v = 0; v < bodies.visible_count; v++) {
+    size_t i = bodies.visible[v];
+    float radius = bodies.bounds.radius[i];
+    float distance2 = glm_vec3_norm2(bodies.render_position[i]);
+    bodies.screen_radius[i] = distance2 > radius * radius ? focal_length * radius / sqrtf(distance2 - radius * radius) : FLT_MAX;
 
-  // Draw the sun
-  drawRenderable(sol.renderable, alpha); 
+    if (bodies.renderable[i].lods)
+      bodies.lod[i] = selectLOD(bodies.renderable[i].lods, bodies.screen_radius[i], bodies.lod[i]);
+
+    // Bodies drawn with the default sphere are ray traced instead whenever the camera is far enough away
+    bodies.impostor[i] = USE_SPHERE_IMPOSTORS && bodies.renderable[i].lods == &sphere_lods &&
+      impostorFits(bodies.render_position[i], radius);
+  }
+
+  // Queue a key for every body left to draw on the CPU and sort the render queue
+  size_t queue_count = 0;
+  for (size_t v = 0; v < bodies.visible_count; v++) {
+    size_t i = bodies.visible[v];
+    const mesh_t *mesh = bodyMesh(i);
+    if (!bodies.impostor[i] && mesh->vertex_count == 0)
+      continue;   // Nothing to draw (a body that hasn't been given a mesh yet)
+    if (bodies.impostor[i])
+      draw_keys[queue_count++] = buildDrawKey(i, DRAW_PASS_IMPOSTOR, 0);
+    else {
+      GLuint mesh_slot = bodies.mesh_slot[i] + (bodies.renderable[i].lods ? bodies.lod[i] : 0);
+      draw_keys[queue_count++] = buildDrawKey(i, mesh->ebo ? DRAW_PASS_INDEXED : DRAW_PASS_ARRAYS, mesh_slot);
+    }
+  }
+  radixSortKeys(draw_keys, draw_key_scratch, queue_count, DRAW_KEY_BODY_BITS);
+
+  // Each run of keys that only differ in depth and body is a batch, write the instances in queue order straight into
+  // the stream ring. Each is built on the stack and copied whole so the (possibly write combined) ring is never read.
+  beginStreamRingFrame(&stream_ring);
+  GLuint first_instance = 0;
+  instance_t *instances = queue_count > 0 ? mapInstances(queue_count, &first_instance) : NULL;
+  batch_count = 0;
+  for (size_t k = 0; k < queue_count; k++) {
+    size_t i = (size_t)(draw_keys[k] & DRAW_KEY_BODY_MASK);
+    if (k == 0 || draw_keys[k] >> DRAW_KEY_MESH_SHIFT != draw_keys[k - 1] >> DRAW_KEY_MESH_SHIFT)
+      batches[batch_count++] = (draw_batch_t){
+        bodies.impostor[i] ? NULL : bodyMesh(i), bodies.renderable[i].texture.id, first_instance + (GLuint)k, 0, 0
+      };
+    draw_batch_t *batch = &batches[batch_count - 1];
+    instance_t instance;
+    if (bodies.impostor[i])
+      buildImpostorInstance(bodies.render_position[i], bodies.frame_orientation[i], bodies.bounds.radius[i], &instance);
+    else {
+      glm_mat4_copy(bodies.model_matrix[i], instance.transform);
+      if (batch->mesh->position_scale != 1.0f)
+        glm_scale_uni(instance.transform, batch->mesh->position_scale);  // Undo the normalization of packed positions
+    }
+    memcpy(&instances[k], &instance, sizeof(instance_t));
+    batch->count++;
+  }
+  if (instances)
+    unmapStreamRing(&stream_ring);
 
-  // Draw the planets and moons etc.
+  // Let the GPU cull the default sphere bodies while the CPU batches are drawn
+  if (gpu_culling)
+    dispatchCulling(focal_length, (const vec4 *)occluders, occluder_count);
+
+  // Every draw's uniforms go into the stream ring at once
+  writeUniformBlocks(alpha, batches, batch_count);
+
+  // Draw the sun, planets, and moons etc. with one multi draw per run of batches or one draw call per batch
+  size_t drawn = multi_draw_indirect ? drawMeshBatchesIndirect() : 0;
+  for (size_t k = drawn; k < batch_count; k++) {
+    const draw_batch_t *batch = &batches[k];
+    if (batch->mesh)
+      drawMeshInstances(batch->mesh, batch->texture, batch->block, batch->first, batch->count);
+  }
+  if (gpu_culling)
+    drawCulledMeshes();
+
+  // Ray trace the impostors together so the vao only changes once
+  if (USE_SPHERE_IMPOSTORS) {
+    bindVertexArray(procedural_vao);
+    for (size_t k = 0; k < batch_count; k++) {
+      const draw_batch_t *batch = &batches[k];
+      if (batch->mesh)
+        continue;   // Drawn above
+      setInstanceAttributes(stream_ring.buffer, batch->first);
+      useImpostorVariant(batch->texture);
+      bindTexture(batch->texture);
+      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, batch->count);   // One quad per sphere
+    }
+    if (gpu_culling)
+      drawCulledImpostors();
+  }
+
+  endStreamRingFrame(&stream_ring);   // The frame's region can be written again once these draws are done
 }
 
 void freeScene(void) {
   // Delete all the meshes and renderables
+  freeMeshLODs(&sphere_lods);
+  freeGeometryBuffer();
+
+  // Free the body table
+  freeHighPVectorArray(&bodies.position);
+  freeHighPVectorArray(&bodies.prev_position);
+  freeHighPVectorArray(&bodies.frame_position);
+  free(bodies.orientation);
+  free(bodies.scale);
+  free(bodies.render_position);
+  free(bodies.frame_orientation);
+  free(bodies.frame_scale);
+  free(bodies.model_matrix);
+  freeBoundingSphereArray(&bodies.bounds);
+  freeBoundingSphereArray(&bodies.cpu_bounds);
+  free(bodies.cpu_body);
+  free(bodies.visible);
+  bodies.visible_count = 0;
+  free(bodies.screen_radius);
+  free(bodies.lod);
+  free(bodies.impostor);
+  free(bodies.mesh_slot);
+  free(bodies.texture_slot);
+  free(bodies.renderable);
+  bodies.count = 0;
+  free(batches);
+  free(draw_keys);
+  free(draw_key_scratch);
+  free(queue_meshes);
+  free(queue_mesh_states);
+  free(queue_textures);
+  queue_mesh_count = queue_state_count = queue_texture_count = 0;
+  free(cull_groups);
 
   glDeleteVertexArrays(1, &vao);  // Delete the vertex array object
-  glDeleteProgram(program);   // Delete the program object
+  glDeleteVertexArrays(1, &procedural_vao);
+  if (gpu_culling) {
+    freeShaderProgram(cull_program);
+    glDeleteBuffers(1, &lod_state_buffer);
+    glDeleteBuffers(1, &culled_instance_buffer);
+  }
+  freeShaderVariants(&scene_variants);   // Delete every variant's program object
+  freeShaderVariants(&impostor_variants);
+  freeStreamRing(&stream_ring);
+  invalidateGLStateCache();   // The objects the state cache remembers are gone
 }
\ No newline at end of file
@@ -0,0 +1,48 @@
+/**
+ * @file bake_meshes.c
+ * @author Joseph St. Pierre
+ * @brief Build time tool that bakes the scene's generated meshes into the mesh cache
+ * @version 0.1
+ * @date 2019-11-24
+ * 
+ * @copyright Copyright (c) 2019
+ * 
+ */
+
+
+// INCLUDES //
+
+#include "rtssp/graphics.h"
+#include "rtssp/scene.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+// FUNCTIONS //
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <mesh cache directory>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Bake every level of detail of the default sphere
+  for (GLuint i = 0; i < DEFAULT_SPHERE_LODS; i++) {
+    GLuint subdivisions = DEFAULT_SPHERE_SUBDIVISIONS - i;
+
+    char path[MESH_CACHE_PATH_SIZE];
+    getIcosphereCachePath(path, sizeof(path), argv[1], 1.0f, subdivisions);
+
+    mesh_blob_t *blob = bakeIcosphereMesh(1.0f, subdivisions);
+    bool saved = saveMeshBlob(path, blob);
+    free(blob);
+
+    if (!saved) {
+      fprintf(stderr, "Failed to write %s!\n", path);
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
\ No newline at end of file
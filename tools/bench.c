@@ -0,0 +1,421 @@
+/**
+ * @file bench.c
+ * @author Joseph St. Pierre
+ * @brief Benchmarks the SIMD paths of the batched math and culling against each other (checking they agree with the
+ * scalar path), the radix sort, and the drift of fixed point positions against highp ones
+ * @version 0.1
+ * @date 2019-11-25
+ *
+ * @copyright Copyright (c) 2019
+ *
+ */
+
+
+// INCLUDES //
+
+#define _POSIX_C_SOURCE 199309L   // For clock_gettime
+
+#include "rtssp/math.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <time.h>
+
+
+// DEFINES //
+
+#define BENCH_VECTORS       (1 << 14)   // The vectors each batched highp function is timed on (sized to stay in cache)
+#define BENCH_VECTOR_REPS   2000        // How many times each is run
+#define BENCH_CHECK_VECTORS 1003        // The vectors the SIMD paths are checked on (not a multiple of any width)
+#define BENCH_SPHERES       (1 << 20)   // The most bounding spheres culled at once
+#define BENCH_CULL_REPS     20          // How many times each set is culled
+#define BENCH_SORT_KEYS     100000      // The keys sorted at once
+#define BENCH_SORT_REPS     50          // How many times they are sorted
+#define BENCH_DRIFT_BODIES  100000      // The bodies drifted by both position types
+#define BENCH_DRIFT_STEPS   1000        // The steps they are drifted for
+#define BENCH_DRIFT_DT      (1.0 / 60.0)  // The length of a step (in seconds)
+#define BENCH_DRIFT_RADIUS  4.5e12      // How far from the origin the bodies start (about Neptune in meters)
+
+
+// LOCAL DATA //
+
+static const char *const simd_paths[] = {"scalar", "avx2", "avx512"};  // Every path there is to time
+
+
+// LOCAL FUNCTIONS //
+
+/**
+ * @brief Local helper that reads the monotonic clock
+ *
+ * @return double   The time in nanoseconds
+ */
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/**
+ * @brief Local helper that gives a uniformly distributed random number (not for anything but test data)
+ *
+ * @param min
+ * @param max
+ * @return double
+ */
+static double randomRange(double min, double max) {
+  return min + (max - min) * (rand() / (double)RAND_MAX);
+}
+
+/**
+ * @brief Local helper that fills a span of high precision vectors with random components
+ *
+ * @param v
+ * @param count
+ * @param range   The largest magnitude of a component
+ */
+static void randomVectors(const highp_vec3_soa *v, size_t count, double range) {
+  for (size_t i = 0; i < count; i++) {
+    v->x[i] = randomRange(-range, range);
+    v->y[i] = randomRange(-range, range);
+    v->z[i] = randomRange(-range, range);
+  }
+}
+
+/**
+ * @brief Local helper that gives the largest difference between two arrays relative to scale
+ *
+ * @param a
+ * @param b
+ * @param count
+ * @param scale   The magnitude of the values the arrays were computed from
+ * @return double
+ */
+static double maxDifference(const double *a, const double *b, size_t count, double scale) {
+  double difference = 0.0;
+  for (size_t i = 0; i < count; i++)
+    difference = fmax(difference, fabs(a[i] - b[i]) / scale);
+  return difference;
+}
+
+/**
+ * @brief Local helper that times the batched highp functions on the current SIMD path
+ *
+ */
+static void benchVectors(void) {
+  highp_vec3_soa a = allocHighPVectorArray(BENCH_VECTORS), b = allocHighPVectorArray(BENCH_VECTORS);
+  highp_vec3_soa c = allocHighPVectorArray(BENCH_VECTORS);
+  vec3 *relative = (vec3 *)malloc(sizeof(vec3) * BENCH_VECTORS);
+  if (!a.x || !b.x || !c.x || !relative) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  randomVectors(&a, BENCH_VECTORS, 1e12);
+  randomVectors(&b, BENCH_VECTORS, 1e12);
+  randomVectors(&c, BENCH_VECTORS, 1e12);
+  highp_vec3 origin = {1e11, -2e11, 3e11};
+
+  double start = now();
+  for (int r = 0; r < BENCH_VECTOR_REPS; r++)
+    addHighPVectorArrays(&a, &b, &c, BENCH_VECTORS);
+  double add = (now() - start) / BENCH_VECTOR_REPS;
+
+  start = now();
+  for (int r = 0; r < BENCH_VECTOR_REPS; r++)
+    axpyHighPVectorArrays(1e-9, &a, &c, BENCH_VECTORS);
+  double axpy = (now() - start) / BENCH_VECTOR_REPS;
+
+  start = now();
+  for (int r = 0; r < BENCH_VECTOR_REPS; r++)
+    lerpHighPVectorArrays(&a, &b, 0.25, &c, BENCH_VECTORS);
+  double lerp = (now() - start) / BENCH_VECTOR_REPS;
+
+  start = now();
+  for (int r = 0; r < BENCH_VECTOR_REPS; r++)
+    convertHighPVectorArrayRelative(&a, &origin, relative, DEFAULT_HIGHP_TO_VEC3_SCALE_FACTOR, BENCH_VECTORS);
+  double convert = (now() - start) / BENCH_VECTOR_REPS;
+
+  printf("  vectors/ns   add %.2f  axpy %.2f  lerp %.2f  convert relative %.2f\n",
+    BENCH_VECTORS / add, BENCH_VECTORS / axpy, BENCH_VECTORS / lerp, BENCH_VECTORS / convert);
+
+  freeHighPVectorArray(&a);
+  freeHighPVectorArray(&b);
+  freeHighPVectorArray(&c);
+  free(relative);
+}
+
+/**
+ * @brief Local helper that runs every batched highp function on the current SIMD path and on the scalar path and
+ * prints how far apart they end up. The fused multiply adds of the SIMD kernels round once where the scalar ones round
+ * twice, so axpy and lerp may differ in the last bit; everything else has to match exactly.
+ *
+ * @param path    The name of the current SIMD path
+ * @return true   If every function agrees with the scalar path
+ * @return false  If any doesn't
+ */
+static bool checkVectors(const char *path) {
+  const size_t n = BENCH_CHECK_VECTORS;
+  highp_vec3_soa a = allocHighPVectorArray(n), b = allocHighPVectorArray(n);
+  highp_vec3_soa sum[2], accumulated[2], interpolated[2];
+  fixed_vec3_soa drifted[2];
+  vec3 *relative[2];
+  bool allocated = a.x && b.x;
+  for (int k = 0; k < 2; k++) {
+    sum[k] = allocHighPVectorArray(n);
+    accumulated[k] = allocHighPVectorArray(n);
+    interpolated[k] = allocHighPVectorArray(n);
+    drifted[k] = allocFixedVectorArray(n);
+    relative[k] = (vec3 *)malloc(sizeof(vec3) * n);
+    allocated &= sum[k].x && accumulated[k].x && interpolated[k].x && drifted[k].x && relative[k];
+  }
+  if (!allocated) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  srand(11);
+  randomVectors(&a, n, 1e12);
+  randomVectors(&b, n, 1e12);
+  highp_vec3 origin = {1e11, -2e11, 3e11};
+
+  // Run everything on the scalar path (k = 0), then on the one being checked (k = 1)
+  for (int k = 0; k < 2; k++) {
+    setHighPSimdPath(k == 0 ? "scalar" : path);
+    addHighPVectorArrays(&a, &b, &sum[k], n);
+    memcpy(accumulated[k].x, b.x, sizeof(double) * n);
+    memcpy(accumulated[k].y, b.y, sizeof(double) * n);
+    memcpy(accumulated[k].z, b.z, sizeof(double) * n);
+    axpyHighPVectorArrays(0.375, &a, &accumulated[k], n);
+    lerpHighPVectorArrays(&a, &b, 0.3, &interpolated[k], n);
+    convertHighPVectorArrayRelative(&a, &origin, relative[k], DEFAULT_HIGHP_TO_VEC3_SCALE_FACTOR, n);
+    for (size_t i = 0; i < n; i++)
+      drifted[k].x[i] = drifted[k].y[i] = drifted[k].z[i] = (int64_t)1 << 50;
+    for (int step = 0; step < 10; step++)
+      driftFixedPositions(&drifted[k], &a, 1e-3, n);
+  }
+
+  double add = 0.0, axpy = 0.0, lerp = 0.0, convert = 0.0;
+  add = fmax(maxDifference(sum[0].x, sum[1].x, n, 1e12), maxDifference(sum[0].y, sum[1].y, n, 1e12));
+  add = fmax(add, maxDifference(sum[0].z, sum[1].z, n, 1e12));
+  axpy = fmax(maxDifference(accumulated[0].x, accumulated[1].x, n, 1e12),
+    maxDifference(accumulated[0].y, accumulated[1].y, n, 1e12));
+  axpy = fmax(axpy, maxDifference(accumulated[0].z, accumulated[1].z, n, 1e12));
+  lerp = fmax(maxDifference(interpolated[0].x, interpolated[1].x, n, 1e12),
+    maxDifference(interpolated[0].y, interpolated[1].y, n, 1e12));
+  lerp = fmax(lerp, maxDifference(interpolated[0].z, interpolated[1].z, n, 1e12));
+  for (size_t i = 0; i < n; i++) {
+    for (int c = 0; c < 3; c++)
+      convert = fmax(convert, fabs(relative[0][i][c] - relative[1][i][c]));
+  }
+  bool drift = memcmp(drifted[0].x, drifted[1].x, sizeof(int64_t) * n) == 0 &&
+    memcmp(drifted[0].y, drifted[1].y, sizeof(int64_t) * n) == 0 &&
+    memcmp(drifted[0].z, drifted[1].z, sizeof(int64_t) * n) == 0;
+
+  // A fused multiply add is off by at most about one rounding of the largest term
+  bool agree = add == 0.0 && axpy <= 2.0 * DBL_EPSILON && lerp <= 2.0 * DBL_EPSILON && convert == 0.0 && drift;
+  printf("  vs scalar    add %.2g  axpy %.2g  lerp %.2g  convert relative %.2g  drift %s%s\n",
+    add, axpy, lerp, convert, drift ? "same" : "different", agree ? "" : "  (MISMATCH)");
+
+  freeHighPVectorArray(&a);
+  freeHighPVectorArray(&b);
+  for (int k = 0; k < 2; k++) {
+    freeHighPVectorArray(&sum[k]);
+    freeHighPVectorArray(&accumulated[k]);
+    freeHighPVectorArray(&interpolated[k]);
+    freeFixedVectorArray(&drifted[k]);
+    free(relative[k]);
+  }
+  return agree;
+}
+
+/**
+ * @brief Local helper that times frustum culling on the current SIMD path, below and above PARALLEL_CULL_THRESHOLD
+ *
+ */
+static void benchCulling(void) {
+  bounding_sphere_soa spheres = allocBoundingSphereArray(BENCH_SPHERES);
+  uint32_t *visible = (uint32_t *)malloc(sizeof(uint32_t) * BENCH_SPHERES);
+  if (!spheres.x || !visible) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Spheres all around a camera at the origin looking down -z, so about a sixth of them are in view
+  srand(42);
+  for (size_t i = 0; i < BENCH_SPHERES; i++) {
+    spheres.x[i] = (float)randomRange(-1000.0, 1000.0);
+    spheres.y[i] = (float)randomRange(-1000.0, 1000.0);
+    spheres.z[i] = (float)randomRange(-1000.0, 1000.0);
+    spheres.radius[i] = (float)randomRange(0.1, 10.0);
+  }
+  mat4 projection, view, view_projection;
+  glm_perspective(glm_rad(60.0f), 16.0f / 9.0f, 0.1f, 2000.0f, projection);
+  glm_lookat((vec3){0.0f, 0.0f, 0.0f}, (vec3){0.0f, 0.0f, -1.0f}, (vec3){0.0f, 1.0f, 0.0f}, view);
+  glm_mat4_mul(projection, view, view_projection);
+  vec4 planes[6];
+  glm_frustum_planes(view_projection, planes);
+
+  size_t counts[] = {PARALLEL_CULL_THRESHOLD - 1, BENCH_SPHERES};   // One thread, then split across threads
+  printf("  culled/us   ");
+  for (size_t k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+    size_t visible_count = 0;
+    double start = now();
+    for (int r = 0; r < BENCH_CULL_REPS; r++)
+      visible_count = cullBoundingSpheres((const vec4 *)planes, &spheres, visible, counts[k]);
+    double elapsed = (now() - start) / BENCH_CULL_REPS;
+    printf(" %zu spheres %.1f (%zu visible)", counts[k], counts[k] / (elapsed / 1e3), visible_count);
+  }
+  printf("\n");
+
+  freeBoundingSphereArray(&spheres);
+  free(visible);
+}
+
+/**
+ * @brief Local helper that times radixSortKeys on random keys and on keys laid out like the render queue's (a few
+ * passes, textures, and meshes, 16 bits of depth, and the index they were queued in order of)
+ *
+ */
+static void benchSort(void) {
+  uint64_t *keys = (uint64_t *)malloc(sizeof(uint64_t) * BENCH_SORT_KEYS);
+  uint64_t *scratch = (uint64_t *)malloc(sizeof(uint64_t) * BENCH_SORT_KEYS);
+  uint64_t *unsorted = (uint64_t *)malloc(sizeof(uint64_t) * BENCH_SORT_KEYS);
+  if (!keys || !scratch || !unsorted) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("sort of %d keys\n", BENCH_SORT_KEYS);
+  srand(3);
+  for (int layout = 0; layout < 2; layout++) {
+    int ordered_bits = layout == 0 ? 0 : 17;
+    for (size_t i = 0; i < BENCH_SORT_KEYS; i++) {
+      if (layout == 0)
+        unsorted[i] = (uint64_t)rand() << 42 ^ (uint64_t)rand() << 21 ^ (uint64_t)rand();
+      else {
+        uint32_t depth = 0x4A000000u + (uint32_t)rand() % 0x3000000u;   // Distances squared from 2e6 to 3e7
+        unsorted[i] = (uint64_t)(rand() % 3) << 62 | (uint64_t)(rand() % 16) << 52 | (uint64_t)(rand() % 4) << 48 |
+          (uint64_t)(rand() % 32) << 36 | (uint64_t)(depth >> 16) << 20 | i;
+      }
+    }
+
+    double best = INFINITY;
+    bool sorted = true;
+    for (int r = 0; r < BENCH_SORT_REPS; r++) {
+      memcpy(keys, unsorted, sizeof(uint64_t) * BENCH_SORT_KEYS);
+      double start = now();
+      radixSortKeys(keys, scratch, BENCH_SORT_KEYS, ordered_bits);
+      best = fmin(best, now() - start);
+    }
+    for (size_t i = 1; i < BENCH_SORT_KEYS; i++)
+      sorted &= keys[i - 1] <= keys[i];
+    printf("  %-12s %.3f ms%s\n", layout == 0 ? "random" : "render queue", best / 1e6, sorted ? "" : " (NOT SORTED)");
+  }
+
+  free(keys);
+  free(scratch);
+  free(unsorted);
+}
+
+/**
+ * @brief Local helper that drifts the same bodies far from the origin as fixed point and highp positions on the
+ * current SIMD path and measures how far each ends up from the exact answer (accumulated in long double)
+ *
+ */
+static void benchDrift(void) {
+  fixed_vec3_soa fixed = allocFixedVectorArray(BENCH_DRIFT_BODIES);
+  highp_vec3_soa highp = allocHighPVectorArray(BENCH_DRIFT_BODIES);
+  highp_vec3_soa velocities = allocHighPVectorArray(BENCH_DRIFT_BODIES);
+  long double (*exact)[3] = malloc(sizeof(*exact) * BENCH_DRIFT_BODIES);
+  if (!fixed.x || !highp.x || !velocities.x || !exact) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Start every body on the fixed point grid so both start out exact
+  srand(7);
+  for (size_t i = 0; i < BENCH_DRIFT_BODIES; i++) {
+    highp_vec3 start = {
+      randomRange(-BENCH_DRIFT_RADIUS, BENCH_DRIFT_RADIUS), randomRange(-BENCH_DRIFT_RADIUS, BENCH_DRIFT_RADIUS),
+      randomRange(-BENCH_DRIFT_RADIUS, BENCH_DRIFT_RADIUS)
+    };
+    fixed_vec3 position = toFixedVector(start);
+    highp_vec3 snapped = fromFixedVector(position);
+    fixed.x[i] = position.x; fixed.y[i] = position.y; fixed.z[i] = position.z;
+    highp.x[i] = snapped.x; highp.y[i] = snapped.y; highp.z[i] = snapped.z;
+    exact[i][0] = snapped.x; exact[i][1] = snapped.y; exact[i][2] = snapped.z;
+    velocities.x[i] = randomRange(-3e4, 3e4); velocities.y[i] = randomRange(-3e4, 3e4);
+    velocities.z[i] = randomRange(-3e4, 3e4);
+  }
+
+  double fixed_time = 0.0, highp_time = 0.0;
+  for (int step = 0; step < BENCH_DRIFT_STEPS; step++) {
+    double start = now();
+    driftFixedPositions(&fixed, &velocities, BENCH_DRIFT_DT, BENCH_DRIFT_BODIES);
+    fixed_time += now() - start;
+
+    start = now();
+    driftHighPPositions(&highp, &velocities, BENCH_DRIFT_DT, BENCH_DRIFT_BODIES);
+    highp_time += now() - start;
+
+    for (size_t i = 0; i < BENCH_DRIFT_BODIES; i++) {
+      exact[i][0] += (long double)velocities.x[i] * BENCH_DRIFT_DT;
+      exact[i][1] += (long double)velocities.y[i] * BENCH_DRIFT_DT;
+      exact[i][2] += (long double)velocities.z[i] * BENCH_DRIFT_DT;
+    }
+  }
+
+  // The largest error of any component
+  double fixed_error = 0.0, highp_error = 0.0;
+  for (size_t i = 0; i < BENCH_DRIFT_BODIES; i++) {
+    highp_vec3 f = fromFixedVector((fixed_vec3){fixed.x[i], fixed.y[i], fixed.z[i]});
+    double fixed_components[3] = {f.x, f.y, f.z}, highp_components[3] = {highp.x[i], highp.y[i], highp.z[i]};
+    for (int k = 0; k < 3; k++) {
+      fixed_error = fmax(fixed_error, (double)fabsl(fixed_components[k] - exact[i][k]));
+      highp_error = fmax(highp_error, (double)fabsl(highp_components[k] - exact[i][k]));
+    }
+  }
+
+  double steps = (double)BENCH_DRIFT_BODIES * BENCH_DRIFT_STEPS;
+  printf("drift of %d bodies near %.1e units over %d steps (%s)\n",
+    BENCH_DRIFT_BODIES, BENCH_DRIFT_RADIUS, BENCH_DRIFT_STEPS, getHighPSimdPath());
+  printf("  fixed point  %.2f ns/body/step  max error %.3g units\n", fixed_time / steps, fixed_error);
+  printf("  highp        %.2f ns/body/step  max error %.3g units\n", highp_time / steps, highp_error);
+
+  freeFixedVectorArray(&fixed);
+  freeHighPVectorArray(&highp);
+  freeHighPVectorArray(&velocities);
+  free(exact);
+}
+
+
+// FUNCTIONS //
+
+int main(void) {
+  // The sort goes first since the wide SIMD kernels can leave the core clocked down for a while after
+  benchSort();
+
+  const char *picked = getHighPSimdPath();
+  printf("picked SIMD path: %s\n", picked);
+
+  // Every path this CPU can run
+  bool agree = true;
+  for (size_t p = 0; p < sizeof(simd_paths) / sizeof(simd_paths[0]); p++) {
+    if (!setHighPSimdPath(simd_paths[p])) {
+      printf("%s: not supported here\n", simd_paths[p]);
+      continue;
+    }
+    printf("%s:\n", simd_paths[p]);
+    if (p > 0)
+      agree &= checkVectors(simd_paths[p]);   // Leaves the path set
+    benchVectors();
+    benchCulling();
+  }
+
+  // The drift is timed on the path this CPU would use
+  setHighPSimdPath(picked);
+  benchDrift();
+
+  return agree ? EXIT_SUCCESS : EXIT_FAILURE;
+}